@@ -1,2 +1,2 @@
 rm main
-g++ -std=c++11 -o main main.cpp vcoin.h vhasher.h -fopenmp $(pkg-config --cflags --libs libbitcoin)
+g++ -std=c++11 -o main main.cpp vcoin.h vhasher.h vmempool.h vbinary.h vfile.h vstore.h vsnapshot.h vverify.h vtxindex.h vhistory.h vjournal.h vpersist.h vingest.h varchive.h vgenerate.h vconfig.h vmetrics.h -fopenmp -pthread $(pkg-config --cflags --libs libbitcoin)
@@ -1,88 +1,533 @@
 #include <iostream>
 #include "vcoin.h"
+#include "vmempool.h"
+#include "vstore.h"
+#include "vsnapshot.h"
+#include "vverify.h"
+#include "vtxindex.h"
+#include "vhistory.h"
+#include "vjournal.h"
+#include "vpersist.h"
+#include "vingest.h"
+#include "varchive.h"
+#include "vgenerate.h"
+#include "vconfig.h"
+#include "vmetrics.h"
 #include <omp.h>
 #include <chrono>
 #include <algorithm>
+#include <unordered_set>
 
-#define USERS_DATA_PATH "users.dat"
-#define TRANSACTIONS_DATA_PATH "transactions.dat"
+#define USERS_DATA_PATH "users.bin"
+#define TRANSACTIONS_DATA_PATH "transactions.bin"
+#define USERS_TEXT_PATH "users.dat"
+#define TRANSACTIONS_TEXT_PATH "transactions.dat"
+#define BLOCKS_DATA_PATH "blocks"
+#define SNAPSHOTS_DATA_PATH "snapshots"
+#define TXINDEX_DATA_PATH BLOCKS_DATA_PATH "/txindex.idx"
+#define HISTORY_DATA_PATH BLOCKS_DATA_PATH "/history"
+#define JOURNAL_DATA_PATH "state.journal"
 
 using namespace VCoin;
 
-int main(int argc, char** argv) {
+// Miner names: a letter per miner, then AA, AB, ... past Z.
+std::string minerName(size_t index) {
+    std::string name;
+    for (++index; index > 0; index = (index - 1) / 26) name.insert(name.begin(), static_cast<char>('A' + (index - 1) % 26));
+    return "1" + name;
+}
+
+// The workload the configuration describes, with its arrival trace loaded.
+WorkloadModel workloadOf(const SimulationConfig& config) {
+    WorkloadModel model = config.workload;
+    if (model.arrivals == ArrivalModel::Trace) model.trace = IO::getArrivalTrace(config.trace);
+    return model;
+}
+
+// What a run mined, for comparing the runs of a sweep.
+struct RunSummary {
+    size_t blocks = 0;
+    size_t transactions = 0;
+    double seconds = 0;       // spent mining
+    size_t staleBlocks = 0;
+};
+
+void printUsage(const Config::Options& options) {
+    std::cout << "Usage: main [command] [--setting=value ...] [--config file] [--sweep setting=v1,v2,... [--overwrite]]\n\n"
+              << "Commands:\n"
+              << "  run                         mine a new simulation, or continue the one in the data directory\n"
+              << "  verify                      re-check the stored chain against the genesis ledger\n"
+              << "  tx <txid>                   show where a transaction is on the active chain\n"
+              << "  history <key> [height]      show an account's balance and transfers up to a height\n"
+              << "  archive <file>              write the active chain's transactions to a columnar archive\n"
+              << "  export-text                 write the state to the text data files\n"
+              << "  generate <file> <count>     write generated transactions to a .dat or binary file, e.g. for --ingest\n\n"
+              << "Config files hold \"setting = value\" lines; settings given directly override them. A sweep\n"
+              << "runs once per combination of values, each in a fresh sweep-<n> directory under data-dir; it\n"
+              << "refuses to start if one of them is not empty, unless --overwrite is given to delete them.\n\n"
+              << "Settings (defaults):\n";
+    options.print(std::cout, SimulationConfig());
+}
+
+// Runs one command against the simulation in config.dataDir; returns the exit status.
+int run(const SimulationConfig& config, const std::string& command, const std::vector<std::string>& args, RunSummary& summary) {
+    auto expectArgs = [&](size_t least, size_t most) {
+        if (args.size() < least || args.size() > most) throw std::invalid_argument("Wrong number of arguments for " + command);
+    };
+    if (command == "run" || command == "verify" || command == "export-text") expectArgs(0, 0);
+    else if (command == "tx" || command == "archive") expectArgs(1, 1);
+    else if (command == "history") expectArgs(1, 2);
+    else if (command == "generate") expectArgs(2, 2);
+    else throw std::invalid_argument("Unknown command " + command);
+    config.validate();
+
+    IO::makeDirectory(config.dataDir);
     VUsers users;
     VTransactions transactions;
 
-//    users = IO::getUsersFromFile(USERS_DATA_PATH);
-//    transactions = IO::getTransactionsFromFile(TRANSACTIONS_DATA_PATH);
+    // The binary data files plus the journal of the blocks since they were last written.
+    StateJournal journal(config.path(JOURNAL_DATA_PATH), config.path(USERS_DATA_PATH), config.path(TRANSACTIONS_DATA_PATH));
+
+    // export-text writes the journaled state out in the text format.
+    if (command == "export-text") {
+        journal.load(users, transactions);
+        IO::writeUsersToFile(config.path(USERS_TEXT_PATH), users);
+        IO::writeTransactionsToFile(config.path(TRANSACTIONS_TEXT_PATH), transactions);
+        std::cout << "Wrote " << config.path(USERS_TEXT_PATH) << " and " << config.path(TRANSACTIONS_TEXT_PATH) << "\n";
+        return 0;
+    }
+
+    // generate <file> <count> writes count transactions between the simulation's users
+    // to a text (.dat) or binary transactions file, e.g. for ingest.
+    if (command == "generate") {
+        const std::string& path = args[0];
+        size_t count;
+        Config::parseValue(args[1], count);
+        const bool text = path.size() >= 4 && path.compare(path.size() - 4, 4, ".dat") == 0;
+        DataGenerator generator(config.seed);
+        std::vector<std::string> keys;
+        for (auto & user : generator.users(config.users, config.minBalance, config.maxBalance)) keys.push_back(std::move(user.key));
+        auto start = std::chrono::steady_clock::now();
+        generator.writeTransactions(path, !text, keys, count, workloadOf(config), std::time(nullptr));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Wrote " << count << " transactions to " << path << " in " << elapsed.count() << "s\n";
+        return 0;
+    }
+
+    // A non-empty block store means a previous run left a chain behind; continue from it
+    // and the state files written alongside instead of generating a new simulation.
+    BlockStore store(config.path(BLOCKS_DATA_PATH));
+    SnapshotManager snapshots(config.path(SNAPSHOTS_DATA_PATH));
+    const bool restoring = !store.empty();
+    // With ingest set, the transactions to mine are streamed from a text or binary
+    // transactions file instead of generated, topping the pool up as blocks drain it.
+    const bool ingesting = !config.ingest.empty();
+    if (command != "run" && !restoring) {
+        std::cout << "No chain in " << config.path(BLOCKS_DATA_PATH) << "/\n";
+        return 0;
+    }
+    if (!restoring) {
+        IO::genRandUsers(users, config.users, config.minBalance, config.maxBalance, config.seed);
+        if (!ingesting) transactions = DataGenerator(config.seed).transactions(userKeys(users), config.transactions, workloadOf(config), std::time(nullptr));
+
+        VBlock genesisBlock;
+        genesisBlock.diffTarget = config.difficulty;
+        std::cout << "Mining genesis block...\n";
+        Miner::mine(genesisBlock);
+        std::string genesisHash = genesisBlock.hash();
+        store.append(genesisHash, genesisBlock);
+        store.setHeight(0, genesisHash);
+        journal.compact(users, transactions, genesisHash);
+        snapshots.clear();
+        snapshots.save(users, 0, genesisHash);
+    }
+    else {
+        std::cout << "Restoring " << store.size() << " blocks from " << config.path(BLOCKS_DATA_PATH) << "/\n";
+        // Runs from before the binary format only left the text file behind.
+        if (access(config.path(TRANSACTIONS_DATA_PATH).c_str(), F_OK) != 0) {
+            IO::transactionsTextToBinary(config.path(TRANSACTIONS_TEXT_PATH), config.path(TRANSACTIONS_DATA_PATH));
+        }
+        journal.load(users, transactions);
+    }
+
+    TxIndex txIndex(config.path(TXINDEX_DATA_PATH));
+    AccountHistory accountHistory(config.path(HISTORY_DATA_PATH));
+    VUsers persistedUsers;
+    UndoLog persistedUndo;
 
-    IO::genRandUsers(users, 1000, 100, 1000000);
-    IO::writeUsersToFile(USERS_DATA_PATH, users);
-    IO::genRandTransactions(transactions, users, 1000, 1, 10000, 3600*7);
-    IO::writeTransactionsToFile(TRANSACTIONS_DATA_PATH, transactions);
+    // Block and index writes, journal records, compactions and snapshots run in order on a
+    // writer thread, so a block is accepted without waiting on file I/O. The writer keeps
+    // its own copy of the ledger, which compactions and snapshots read instead of a copy
+    // made on the mining path.
+    PersistenceQueue persistence(journal, config.maxQueuedWrites, config.syncPolicy);
+    QueuedObserver writers(persistence);
+    writers.add(&store);
 
-    VBlock genesisBlock;
-    std::cout << "Mining genesis block...\n";
-    Miner::mine(genesisBlock);
-    BlockChain chain = BlockChain(genesisBlock);
-    std::cout << "Genesis block hash: " << VHasher::getHash(genesisBlock.toHex()) << "\n\n";
+    BlockChain chain(store.loadActiveHeaders(), &store, store.prunedHeight());
+    chain.addObserver(&writers);
+    chain.setPruneDepth(config.pruneDepth);
+    chain.setMinDifficulty(config.difficulty);
+    UndoLog undoLog;
+
+    // archive <file> writes the transactions of the active chain's unpruned blocks to a
+    // columnar archive.
+    if (command == "archive") {
+        ChainSnapshotHandle active = chain.snapshot();
+        VTransactions history;
+        for (size_t height = active->prunedHeight(); height < active->size(); ++height) {
+            for (const auto & transaction : active->at(height)->transactions) history.push_back(transaction);
+        }
+        size_t bytes = IO::writeTransactionArchive(args[0], history);
+        std::cout << "Archived " << history.size() << " transactions of blocks " << active->prunedHeight() << "-" << active->size() - 1
+                  << " in " << bytes << " bytes (" << (history.empty() ? 0 : 1.0 * bytes / history.size()) << " per transaction)\n";
+        return 0;
+    }
+
+    size_t indexedBlocks = txIndex.catchUp(*chain.snapshot());
+    if (indexedBlocks > 0) std::cout << "Indexed transactions of " << indexedBlocks << " blocks\n";
+    writers.add(&txIndex);
+
+    // tx <txid> prints where a transaction is on the active chain.
+    if (command == "tx") {
+        TxLocation location;
+        if (!txIndex.find(args[0], location)) {
+            std::cout << "Transaction " << args[0] << " is not on the active chain\n";
+            return 1;
+        }
+        std::cout << "Transaction " << args[0] << " is #" << location.position << " in block " << location.height
+                  << " (" << chain.hashAt(location.height) << ")\n";
+        return 0;
+    }
+
+    if (accountHistory.empty()) {
+        VUsers genesisLedger;
+        if (!snapshots.load(*chain.snapshot(), 0, genesisLedger)) {
+            std::cerr << "No genesis ledger snapshot in " << config.path(SNAPSHOTS_DATA_PATH) << "/, delete " << config.path(BLOCKS_DATA_PATH) << "/ to start over\n";
+            return 1;
+        }
+        accountHistory.initialize(genesisLedger, chain.hashAt(0));
+    }
+    accountHistory.catchUp(*chain.snapshot());
+    writers.add(&accountHistory);
+
+    // history <key> [height] prints the account's balance at height (default: the tip)
+    // and its transfers up to it.
+    if (command == "history") {
+        const std::string& key = args[0];
+        uint64_t height = chain.size() - 1;
+        if (args.size() > 1) Config::parseValue(args[1], height);
+        double balance = 0;
+        if (!accountHistory.balanceAt(key, height, balance)) {
+            std::cout << "Account " << key << " does not exist at block " << height << "\n";
+            return 1;
+        }
+        for (size_t cursor = 0; ; ) {
+            HistoryPage page = accountHistory.history(key, cursor, 100);
+            for (const auto & entry : page.entries) {
+                if (entry.height > height) break;
+                std::cout << "Block " << entry.height << " #" << entry.position << ": " << std::showpos << entry.amount
+                          << std::noshowpos << (entry.amount < 0 ? " to " : " from ") << entry.counterparty << "\n";
+            }
+            if (!page.more || page.entries.empty() || page.entries.back().height > height) break;
+            cursor = page.next;
+        }
+        std::cout << "Balance at block " << height << ": " << balance << "\n";
+        return 0;
+    }
+
+    // verify re-checks the stored chain against the genesis ledger.
+    if (command == "verify") {
+        VUsers genesisLedger;
+        bool haveLedger = snapshots.load(*chain.snapshot(), 0, genesisLedger);
+        if (!haveLedger) std::cout << "No genesis ledger snapshot, balances will not be checked\n";
+        VerificationReport report = ChainVerifier(256, config.difficulty).verify(*chain.snapshot(), haveLedger ? &genesisLedger : nullptr);
+        for (const auto & failure : report.failures) {
+            std::cout << "Block " << failure.height << " (" << failure.hash << "): " << failure.reason << "\n";
+        }
+        std::cout << "Verified " << report.blocks << " blocks and " << report.transactions << " transactions in "
+                  << report.seconds << "s (" << report.blocksPerSecond() << " blocks/s): "
+                  << (report.ok() ? "OK" : std::to_string(report.failures.size()) + " problems") << "\n";
+        return report.ok() ? 0 : 2;
+    }
+
+    // Balances come from the journaled state if it is on the active chain, else from the
+    // newest ledger snapshot on it; only the blocks mined after that are replayed, through
+    // the undo log so they can still be reorganized.
+    if (restoring) {
+        ChainSnapshotHandle active = chain.snapshot();
+        uint64_t stateHeight = 0;
+        if (active->contains(journal.blockHash())) {
+            stateHeight = active->heightOf(journal.blockHash());
+            std::cout << "Loaded state journal at height " << stateHeight;
+        }
+        else if (snapshots.loadLatest(*active, users, stateHeight)) {
+            std::cout << "Loaded ledger snapshot at height " << stateHeight;
+        }
+        else {
+            std::cerr << "No usable ledger snapshot in " << config.path(SNAPSHOTS_DATA_PATH) << "/, delete " << config.path(BLOCKS_DATA_PATH) << "/ to start over\n";
+            return 1;
+        }
+        std::unordered_set<std::string> mined;
+        for (size_t height = stateHeight + 1; height < active->size(); ++height) {
+            ChainUpdate replay;
+            replay.status = BlockStatus::ExtendedTip;
+            replay.connected.push_back(ChainBlock{active->hashAt(height), active->at(height)});
+            undoLog.apply(users, replay);
+            for (const auto & transaction : replay.connected.back().block->transactions) mined.insert(transaction.id);
+        }
+        if (!mined.empty()) {
+            transactions.erase(std::remove_if(transactions.begin(), transactions.end(),
+                                              [&mined](const VTransaction& transaction) { return mined.count(transaction.id) != 0; }),
+                               transactions.end());
+        }
+        std::cout << ", replayed " << active->size() - 1 - stateHeight << " blocks\n";
+    }
+    std::cout << "Genesis block hash: " << chain.hashAt(0) << "\n\n";
 
+    const size_t loaded = transactions.size();
     validateTransactions(transactions);
+    Mempool mempool(config.mempoolBytes, EvictionPolicy::LowestPriority, config.mempoolMaxAge);
+    for (auto & transaction : transactions) {
+        mempool.add(std::move(transaction));
+    }
+    transactions.clear();
+    mempool.trackChanges();
+    // Transactions rejected, evicted or expired while loading are not tracked changes, so
+    // the stored state is rewritten without them; otherwise a restart would bring them back.
+    if (mempool.size() != loaded) {
+        const std::string headHash = chain.head();
+        persistence.submit([&]() { journal.compact(users, mempool, headHash); });
+        persistence.flush();
+    }
 
-    const std::string miners[5] = { "1A", "1B", "1C", "1D", "1E" };
-    long long minTime = LLONG_MAX, maxTime = 0;
-    double totalMineTime = 0;
-    while (!transactions.empty()) {
-        int winnerIndex = 0;
-        auto start = std::chrono::steady_clock::now();
-        auto end = std::chrono::steady_clock::now();
-#pragma omp parallel default(none) shared(chain, users, transactions, miners, winnerIndex, start, end, minTime, maxTime, std::cout) num_threads(5)
+    // The writer's ledger starts from the restored one and follows every block from here.
+    persistedUsers = users;
+    size_t journaled = journal.records();
+
+    // A restarted ingestion reads the file from the start; transactions already on the
+    // active chain are skipped.
+    std::unique_ptr<StreamIngestor> ingestor;
+    if (ingesting) ingestor.reset(new StreamIngestor(config.ingest, config.ingestBatch));
+    auto onChain = [&txIndex](const VTransaction& transaction) {
+        TxLocation location;
+        return txIndex.find(transaction.hash(), location);
+    };
+
+    // Per-block measurements go to the metrics file, if one is configured.
+    std::unique_ptr<MetricsSink> metricsSink;
+    if (!config.metrics.empty()) metricsSink.reset(new MetricsSink(config.path(config.metrics)));
+
+    typedef std::chrono::steady_clock Clock;
+    std::vector<std::string> miners;
+    for (size_t i = 0; i < config.miners; ++i) miners.push_back(minerName(i));
+    double minTime = std::numeric_limits<double>::max(), maxTime = 0;
+    while (true) {
+        if (ingestor) ingestor->topUp(mempool, config.ingestTarget(), onChain);
+        if (mempool.empty()) break;
+        mempool.expire(std::time(nullptr));
+
+        // All miners work on the same template, so it is built once instead of per thread.
+        // An empty one means the whole pool was unaffordable and has been dropped. It names
+        // its parent up front: a miner that started after a rival's block was accepted
+        // would otherwise mine the same transactions again on top of that block.
+        BlockMetrics metrics;
+        const Clock::time_point templateStart = Clock::now();
+        VBlock blockTemplate;
+        blockTemplate.prevBlock = chain.head();
+        blockTemplate.diffTarget = config.difficulty;
+        mempool.buildBlock(users, blockTemplate, config.transactionsPerBlock);
+        metrics.templateSeconds = std::chrono::duration<double>(Clock::now() - templateStart).count();
+        if (blockTemplate.transactions.empty()) {
+            if (ingestor && !ingestor->exhausted()) continue;
+            break;
+        }
+
+        // Each miner fills its own slot. The winner only links its block into the chain and
+        // records the update; the ledger, pool and persistence follow once every miner has
+        // stopped, outside the parallel region, so applying a large block can use all the
+        // threads instead of running nested and serial.
+        std::vector<MiningResult> results(config.miners);
+        std::vector<char> stale(config.miners, 0);
+        std::vector<ChainUpdate> updates;
+        std::exception_ptr failure;
+        int winnerIndex = -1;
+        const Clock::time_point start = Clock::now();
+#pragma omp parallel default(none) shared(chain, blockTemplate, miners, results, stale, updates, failure, metrics, winnerIndex, start, config, std::cout) num_threads(config.miners)
         {
-            VUsers pUsers(users);
-            VTransactions pTransactions(transactions);
-
-            VBlock block;
-            validateTransactions(pTransactions);
-            transferTransactionsToBlock(pUsers, pTransactions, block);
-
-            std::cout << std::to_string(chain.size()) + miners[omp_get_thread_num()] + " mining..\n";
-            Miner::mine(block, &chain, omp_get_thread_num() * 10000);
-            if (chain.insert(block)) {
-                end = std::chrono::steady_clock::now();
-                maxTime = std::max(maxTime, std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count());
-                minTime = std::min(minTime, std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count());
-                updateUsersBalance(users, block.transactions);
-                IO::writeUsersToFile(USERS_DATA_PATH, pUsers);
-                IO::writeTransactionsToFile(TRANSACTIONS_DATA_PATH, pTransactions);
-                winnerIndex = omp_get_thread_num();
+            const int miner = omp_get_thread_num();
+            VBlock block(blockTemplate);
+
+            std::cout << std::to_string(chain.size()) + miners[miner] + " mining..\n";
+            // Miners share the template, so each starts 2^40 nonces from the next to keep
+            // them from hashing the same headers.
+            results[miner] = Miner::mine(block, &chain, static_cast<uint64_t>(miner) << 40);
+            // Exceptions cannot leave the region; the first one is rethrown after it.
+            try {
+                ChainUpdate update = chain.insert(block);
+                if (update.tipChanged()) {
+#pragma omp critical(vcoin_state)
+                    {
+                        metrics.miningSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+                        updates.push_back(std::move(update));
+                        winnerIndex = miner;
+                    }
+                }
+                else if (results[miner].found) stale[miner] = 1;
+            }
+            catch (...) {
+#pragma omp critical(vcoin_state)
+                if (!failure) failure = std::current_exception();
             }
         }
-        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end-start);
-        totalMineTime += elapsed.count();
-        std::cout << chain.size()-1 << miners[winnerIndex] << " has finished mining in " << 1.0*elapsed.count()/1000 << "s!\n";
+        if (failure) std::rethrow_exception(failure);
+
+        for (const auto & update : updates) {
+            undoLog.apply(users, update);
+            mempool.applyChainUpdate(update);
+            const Clock::time_point ioStart = Clock::now();
+            const std::string tipHash = update.connected.back().hash;
+            persistence.append(journal.record(update, users, mempool.takeChanges()), tipHash);
+            persistence.post([&persistedUndo, &persistedUsers, update]() { persistedUndo.apply(persistedUsers, update); });
+            if (++journaled % journal.interval() == 0) {
+                auto pool = std::make_shared<VTransactions>();
+                mempool.forEach([&pool](const VTransaction& transaction) { pool->push_back(transaction); });
+                persistence.submit([&journal, &persistedUsers, pool, tipHash]() { journal.compact(persistedUsers, *pool, tipHash); });
+            }
+            ChainSnapshotHandle active = chain.snapshot();
+            if (active->contains(tipHash) && active->heightOf(tipHash) % config.snapshotInterval == 0) {
+                const uint64_t height = active->heightOf(tipHash);
+                persistence.submit([&snapshots, &persistedUsers, height, tipHash]() { snapshots.save(persistedUsers, height, tipHash); });
+            }
+            metrics.ioSeconds += std::chrono::duration<double>(Clock::now() - ioStart).count();
+            metrics.hash = tipHash;
+            if (active->contains(tipHash)) metrics.height = active->heightOf(tipHash);
+        }
+        if (winnerIndex < 0) continue;
+
+        const double blockTime = metrics.miningSeconds;
+        minTime = std::min(minTime, blockTime);
+        maxTime = std::max(maxTime, blockTime);
+        summary.blocks++;
+        summary.transactions += blockTemplate.transactions.size();
+        summary.seconds += blockTime;
+
+        metrics.winner = miners[winnerIndex];
+        metrics.transactions = blockTemplate.transactions.size();
+        metrics.merkleSeconds = results[winnerIndex].merkleSeconds;
+        for (size_t i = 0; i < results.size(); ++i) {
+            MinerMetrics miner;
+            miner.name = miners[i];
+            miner.attempts = results[i].attempts;
+            miner.seconds = results[i].seconds;
+            miner.found = results[i].found;
+            metrics.miners.push_back(miner);
+            metrics.attempts += miner.attempts;
+            if (static_cast<int>(i) != winnerIndex) metrics.staleAttempts += miner.attempts;
+            metrics.staleBlocks += stale[i];
+        }
+        if (metricsSink) metricsSink->record(metrics);
+
+        std::cout << chain.size()-1 << miners[winnerIndex] << " has finished mining in " << blockTime << "s!\n";
         std::cout << "========MINED BLOCK========\n";
-        chain.get(chain.head()).printHeader();
+        chain.get(chain.head())->printHeader();
         std::cout << "===========================\n";
 
+        const MempoolStats& poolStats = mempool.stats();
+        std::cout << "Remaining transactions: " << mempool.size() << " (" << poolStats.bytes << " bytes, "
+                  << poolStats.evicted << " evicted, " << poolStats.expired << " expired)\n\n";
+    }
 
-        users = IO::getUsersFromFile(USERS_DATA_PATH);
-        transactions = IO::getTransactionsFromFile(TRANSACTIONS_DATA_PATH);
+    const std::string headHash = chain.head();
+    persistence.submit([&]() { journal.compact(users, mempool, headHash); });
+    persistence.flush();
+    PersistenceStats persistStats = persistence.stats();
 
-        std::cout << "Remaining transactions: " << transactions.size() << "\n\n";
+    // Block times cover the blocks mined by this run, not the genesis block or restored ones.
+    if (summary.blocks > 0) {
+        std::cout << "Average block mine time: " << summary.seconds/summary.blocks << "s\n";
+        std::cout << "Minimum block mine time: " << minTime << "s\n";
+        std::cout << "Maximum block mine time: " << maxTime << "s\n";
     }
-
-    std::cout << "Average block mine time: " << totalMineTime/chain.size()/1000 << "s\n";
-    std::cout << "Minimum block mine time: " << 1.0*minTime/1000 << "s\n";
-    std::cout << "Maximum block mine time: " << 1.0*maxTime/1000 << "s\n\n";
+    if (metricsSink) std::cout << "Block metrics: " << config.path(config.metrics) << "\n";
+    ChainStats chainStats = chain.stats();
+    summary.staleBlocks = chainStats.staleBlocks;
+    std::cout << "Stale blocks: " << chainStats.staleBlocks << " of " << chainStats.knownBlocks
+              << " (" << 100.0*chainStats.staleBlocks/chainStats.knownBlocks << "%), reorgs: " << chainStats.reorgs << "\n";
+    BlockCacheStats cacheStats = chain.cacheStats();
+    std::cout << "Block cache: " << cacheStats.blocks << " bodies (" << cacheStats.bytes << " bytes), "
+              << cacheStats.hits << " hits, " << cacheStats.misses << " misses, " << cacheStats.evictions << " evictions\n";
+    std::cout << "Persistence: " << persistStats.records << " records (" << persistStats.bytes << " bytes) in " << persistStats.batches
+              << " batches, " << persistStats.syncs << " syncs, peak queue " << persistStats.peakQueued << ", " << persistStats.stalls
+              << " stalls (" << persistStats.stalledSeconds << "s), max lag " << persistStats.maxLagSeconds << "s\n";
+    if (ingestor) {
+        const IngestStats& ingestStats = ingestor->stats();
+        std::cout << "Ingested: " << ingestStats.read << " read in " << ingestStats.batches << " batches, " << ingestStats.added << " added, "
+                  << ingestStats.invalid << " invalid, " << ingestStats.skipped << " already on the chain\n";
+    }
+    std::cout << "\n";
     std::cout << "\nFinal blockchain:\n";
-    int currentBlockIndex = chain.size();
-    std::string currentBlock = chain.head();
-    while (currentBlockIndex > 0)
+    for (size_t height = chain.size(); height > 0; --height)
     {
-        std::cout << "Block " << currentBlockIndex << ": " << currentBlock << "\n";
-        currentBlock = chain.get(currentBlock).prevBlock;
-        currentBlockIndex--;
+        std::cout << "Block " << height << ": " << chain.hashAt(height-1) << "\n";
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char** argv) {
+    Config::Options options;
+    Config::CommandLine line;
+    try {
+        line = Config::parseCommandLine(argc, argv, options);
+        if (line.command == "help") {
+            printUsage(options);
+            return 0;
+        }
+        if (line.sweeps.empty()) {
+            RunSummary summary;
+            return run(line.config, line.command, line.args, summary);
+        }
+        if (line.command != "run") throw std::invalid_argument("Only run can be swept");
+
+        // Every point starts a new simulation in its own directory, so runs do not see
+        // each other's chains. Earlier results are only replaced when asked to, and that is
+        // checked for every point before any of them runs.
+        std::vector<std::vector<std::pair<std::string, std::string>>> points = Config::sweepPoints(line.sweeps);
+        std::vector<std::string> directories;
+        for (size_t i = 0; i < points.size(); ++i) {
+            directories.push_back(line.config.path("sweep-" + std::to_string(i)));
+            if (!line.overwrite && !IO::isEmptyOrMissing(directories.back())) {
+                throw std::invalid_argument(directories.back() + " is not empty; pass --overwrite to replace it or pick another --data-dir");
+            }
+        }
+        IO::makeDirectory(line.config.dataDir);
+        std::vector<RunSummary> summaries(points.size());
+        for (size_t i = 0; i < points.size(); ++i) {
+            SimulationConfig config = line.config;
+            for (const auto & setting : points[i]) options.set(config, setting.first, setting.second);
+            config.dataDir = directories[i];
+            if (line.overwrite) IO::removeTree(config.dataDir);
+            std::cout << "=== Sweep " << i + 1 << " of " << points.size() << " in " << config.dataDir << " ===\n";
+            int status = run(config, line.command, line.args, summaries[i]);
+            if (status != 0) return status;
+        }
+
+        std::cout << "Sweep results:\n";
+        for (size_t i = 0; i < points.size(); ++i) {
+            const RunSummary& summary = summaries[i];
+            for (const auto & setting : points[i]) std::cout << setting.first << "=" << setting.second << " ";
+            std::cout << ": " << summary.blocks << " blocks, " << summary.transactions << " transactions in " << summary.seconds << "s ("
+                      << (summary.seconds > 0 ? summary.transactions / summary.seconds : 0) << " tx/s, "
+                      << (summary.blocks > 0 ? summary.seconds / summary.blocks : 0) << "s per block), " << summary.staleBlocks << " stale\n";
+        }
+        return 0;
+    }
+    catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << "\nRun with --help for usage.\n";
+        return 2;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
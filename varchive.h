@@ -0,0 +1,466 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cmath>
+#include "vcoin.h"
+#include "vfile.h"
+
+namespace VCoin { namespace IO
+    {
+        // Variable-length and bit-packed integers for the archive format.
+        namespace Packing
+        {
+            void putVarint(std::string& out, uint64_t value) {
+                while (value >= 0x80) {
+                    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                    value >>= 7;
+                }
+                out.push_back(static_cast<char>(value));
+            }
+
+            uint64_t zigzag(int64_t value) {
+                return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+            }
+
+            int64_t unzigzag(uint64_t value) {
+                return static_cast<int64_t>((value >> 1) ^ (0 - (value & 1)));
+            }
+
+            // Bits needed for values up to maxValue; widths above 56 are stored as 64 so every
+            // value can be read with a single unaligned 8-byte load.
+            unsigned bitWidth(uint64_t maxValue) {
+                unsigned width = 0;
+                while (width < 64 && (maxValue >> width) != 0) ++width;
+                return width > 56 ? 64 : width;
+            }
+
+            // Packed size of count values, plus padding for the 8-byte loads.
+            size_t packedSize(size_t count, unsigned width) {
+                return (count * width + 7) / 8 + 8;
+            }
+
+            void pack(std::string& out, const std::vector<uint64_t>& values, unsigned width) {
+                const size_t start = out.size();
+                out.resize(start + packedSize(values.size(), width), '\0');
+                if (width == 0) return;
+                char* data = &out[start];
+                for (size_t i = 0; i < values.size(); ++i) {
+                    const size_t bit = i * width;
+                    if (width == 64) {
+                        storeU64(data + bit / 8, values[i]);
+                        continue;
+                    }
+                    uint64_t word = loadU64(data + bit / 8) | (values[i] << (bit % 8));
+                    storeU64(data + bit / 8, word);
+                }
+            }
+
+            // Adds base to each unpacked value; a fixed-width loop without branches on the data.
+            void unpack(const char* data, size_t count, unsigned width, uint64_t base, uint64_t* out) {
+                if (width == 0) {
+                    for (size_t i = 0; i < count; ++i) out[i] = base;
+                }
+                else if (width == 64) {
+                    for (size_t i = 0; i < count; ++i) out[i] = base + loadU64(data + i * 8);
+                }
+                else {
+                    const uint64_t mask = (uint64_t(1) << width) - 1;
+                    for (size_t i = 0; i < count; ++i) {
+                        const size_t bit = i * width;
+                        out[i] = base + ((loadU64(data + bit / 8) >> (bit % 8)) & mask);
+                    }
+                }
+            }
+
+            // Bounds-checked reading from an encoded region.
+            class Cursor
+            {
+            private:
+                const char* at;
+                const char* end;
+
+            public:
+                Cursor(const char* begin, const char* end) : at(begin), end(end) {}
+
+                const char* take(size_t size) {
+                    if (size > static_cast<size_t>(end - at)) throw std::runtime_error("Truncated archive data");
+                    const char* taken = at;
+                    at += size;
+                    return taken;
+                }
+
+                uint8_t byte() {
+                    return static_cast<uint8_t>(*take(1));
+                }
+
+                uint64_t varint() {
+                    uint64_t value = 0;
+                    for (unsigned shift = 0; shift < 64; shift += 7) {
+                        uint8_t next = byte();
+                        value |= static_cast<uint64_t>(next & 0x7f) << shift;
+                        if ((next & 0x80) == 0) return value;
+                    }
+                    throw std::runtime_error("Malformed varint in archive");
+                }
+
+                std::string string() {
+                    size_t size = static_cast<size_t>(varint());
+                    return std::string(take(size), size);
+                }
+
+                bool done() const {
+                    return at == end;
+                }
+            };
+        }
+
+        // One decoded archive block, column by column. Accounts are dictionary indices.
+        struct ArchiveBlock {
+            std::vector<uint32_t> senders;
+            std::vector<uint32_t> receivers;
+            std::vector<int64_t> timestamps;
+            std::vector<double> sums;
+            std::vector<std::pair<uint32_t, std::string>> ids; // positions whose id is not their body's hash
+
+            size_t size() const {
+                return senders.size();
+            }
+        };
+
+        // Columnar transaction archive. Accounts are stored once in a dictionary and the
+        // transactions in blocks of up to kArchiveBlockSize, each column on its own:
+        //   senders, receivers  dictionary indices minus the block's smallest, bit-packed
+        //   timestamps          first value, then zigzag deltas from the previous, bit-packed
+        //   sums                fixed point with the fewest decimals that reproduce every sum
+        //                       of the block exactly, bit-packed; raw doubles otherwise
+        //   ids                 only those that differ from the body's hash
+        // The file is a 64-byte header { magic, version, count, blocks, accounts, dictionary
+        // offset, index offset, checksum } followed by the dictionary, the blocks and an index
+        // of block offsets. The checksum (FNV-1a over everything after the header) is verified
+        // when the archive is opened. Decoding rehashes the transactions, which restores ids.
+        const size_t kArchiveBlockSize = 4096;
+
+        class TransactionArchive
+        {
+        private:
+            static const size_t kHeaderSize = 64;
+            static const unsigned kMaxDecimals = 8;
+
+            MappedFile file;
+            std::vector<std::string> dictionary;
+            std::vector<uint64_t> offsets;   // blocks + 1 entries
+
+            static uint64_t scaleOf(unsigned decimals) {
+                uint64_t scale = 1;
+                for (unsigned i = 0; i < decimals; ++i) scale *= 10;
+                return scale;
+            }
+
+            static bool sameBits(double a, double b) {
+                return std::memcmp(&a, &b, sizeof(a)) == 0;
+            }
+
+            // Fixed-point value of sum with the given decimals, if it reproduces sum exactly.
+            static bool toFixed(double sum, unsigned decimals, int64_t& fixed) {
+                const double scale = static_cast<double>(scaleOf(decimals));
+                const double scaled = sum * scale;
+                if (!(std::fabs(scaled) < 9007199254740992.0)) return false; // 2^53, also rejects NaN
+                fixed = std::llround(scaled);
+                return sameBits(static_cast<double>(fixed) / scale, sum);
+            }
+
+            static void putAccounts(std::string& out, const std::vector<uint64_t>& indices) {
+                uint64_t low = indices.empty() ? 0 : *std::min_element(indices.begin(), indices.end());
+                uint64_t high = indices.empty() ? 0 : *std::max_element(indices.begin(), indices.end());
+                std::vector<uint64_t> offsets(indices.size());
+                for (size_t i = 0; i < indices.size(); ++i) offsets[i] = indices[i] - low;
+                const unsigned width = Packing::bitWidth(high - low);
+                Packing::putVarint(out, low);
+                out.push_back(static_cast<char>(width));
+                Packing::pack(out, offsets, width);
+            }
+
+            static void getAccounts(Packing::Cursor& in, size_t count, size_t accounts, std::vector<uint32_t>& out) {
+                const uint64_t low = in.varint();
+                const unsigned width = in.byte();
+                std::vector<uint64_t> values(count);
+                Packing::unpack(in.take(Packing::packedSize(count, width)), count, width, low, values.data());
+                out.resize(count);
+                for (size_t i = 0; i < count; ++i) {
+                    if (values[i] >= accounts) throw std::runtime_error("Account index out of range in archive");
+                    out[i] = static_cast<uint32_t>(values[i]);
+                }
+            }
+
+            static std::string encodeBlock(const VTransactions& transactions, size_t first, size_t count,
+                                           const std::unordered_map<std::string, uint32_t>& accounts) {
+                std::string out;
+                Packing::putVarint(out, count);
+
+                std::vector<uint64_t> senders(count), receivers(count);
+                for (size_t i = 0; i < count; ++i) {
+                    senders[i] = accounts.at(transactions[first + i].sender());
+                    receivers[i] = accounts.at(transactions[first + i].receiver());
+                }
+                putAccounts(out, senders);
+                putAccounts(out, receivers);
+
+                std::vector<uint64_t> deltas(count > 0 ? count - 1 : 0);
+                uint64_t widest = 0;
+                for (size_t i = 1; i < count; ++i) {
+                    uint64_t delta = static_cast<uint64_t>(transactions[first + i].timestamp()) - static_cast<uint64_t>(transactions[first + i - 1].timestamp());
+                    deltas[i - 1] = Packing::zigzag(static_cast<int64_t>(delta));
+                    widest = std::max(widest, deltas[i - 1]);
+                }
+                Packing::putVarint(out, count > 0 ? Packing::zigzag(static_cast<int64_t>(transactions[first].timestamp())) : 0);
+                const unsigned timeWidth = Packing::bitWidth(widest);
+                out.push_back(static_cast<char>(timeWidth));
+                Packing::pack(out, deltas, timeWidth);
+
+                // The fewest decimals that hold every sum of the block, if any do.
+                std::vector<int64_t> fixed(count);
+                unsigned decimals = 0;
+                bool exact = false;
+                for (; decimals <= kMaxDecimals && !exact; ++decimals) {
+                    exact = true;
+                    for (size_t i = 0; i < count && exact; ++i) exact = toFixed(transactions[first + i].sum(), decimals, fixed[i]);
+                }
+                if (exact) {
+                    --decimals;
+                    int64_t low = count > 0 ? *std::min_element(fixed.begin(), fixed.end()) : 0;
+                    std::vector<uint64_t> values(count);
+                    uint64_t highest = 0;
+                    for (size_t i = 0; i < count; ++i) {
+                        values[i] = static_cast<uint64_t>(fixed[i]) - static_cast<uint64_t>(low);
+                        highest = std::max(highest, values[i]);
+                    }
+                    const unsigned width = Packing::bitWidth(highest);
+                    out.push_back(static_cast<char>(decimals));
+                    Packing::putVarint(out, Packing::zigzag(low));
+                    out.push_back(static_cast<char>(width));
+                    Packing::pack(out, values, width);
+                }
+                else {
+                    out.push_back(static_cast<char>(0xff));
+                    const size_t start = out.size();
+                    out.resize(start + count * 8);
+                    for (size_t i = 0; i < count; ++i) {
+                        uint64_t bits;
+                        double sum = transactions[first + i].sum();
+                        std::memcpy(&bits, &sum, sizeof(bits));
+                        storeU64(&out[start + i * 8], bits);
+                    }
+                }
+
+                std::vector<size_t> foreign;
+                for (size_t i = 0; i < count; ++i) {
+                    if (!transactions[first + i].hasValidId()) foreign.push_back(i);
+                }
+                Packing::putVarint(out, foreign.size());
+                for (size_t i : foreign) {
+                    const std::string& id = transactions[first + i].id;
+                    Packing::putVarint(out, i);
+                    Packing::putVarint(out, id.size());
+                    out += id;
+                }
+                return out;
+            }
+
+        public:
+            static const uint32_t kMagic = 0x41585456;   // "VTXA"
+            static const uint32_t kVersion = 1;
+
+            // Throws std::runtime_error if the file is missing, truncated or corrupt.
+            explicit TransactionArchive(const std::string& fpath) : file(fpath) {
+                const char* data = file.data();
+                if (file.size() < kHeaderSize || loadU32(data) != kMagic || loadU32(data + 4) != kVersion) {
+                    throw std::runtime_error("Unrecognized transaction archive " + fpath);
+                }
+                const uint64_t blocks = loadU32(data + 16);
+                const uint64_t dictionaryOffset = loadU64(data + 24), indexOffset = loadU64(data + 32);
+                if (dictionaryOffset < kHeaderSize || indexOffset < dictionaryOffset || indexOffset + (blocks + 1) * 8 != file.size()) {
+                    throw std::runtime_error("Truncated transaction archive " + fpath);
+                }
+                if (loadU64(data + 40) != fnv1a(kFnvOffsetBasis, data + kHeaderSize, file.size() - kHeaderSize)) {
+                    throw std::runtime_error("Corrupt transaction archive " + fpath);
+                }
+
+                Packing::Cursor in(data + dictionaryOffset, data + loadU64(data + indexOffset));
+                dictionary.resize(loadU32(data + 20));
+                for (auto & key : dictionary) {
+                    if (in.byte() == 0) {
+                        bc::hash_digest digest;
+                        std::memcpy(digest.data(), in.take(digest.size()), digest.size());
+                        key = bc::encode_base16(digest);
+                    }
+                    else key = in.string();
+                }
+                if (!in.done()) throw std::runtime_error("Corrupt transaction archive " + fpath);
+
+                offsets.resize(blocks + 1);
+                for (size_t i = 0; i <= blocks; ++i) {
+                    offsets[i] = loadU64(data + indexOffset + i * 8);
+                    if (offsets[i] > indexOffset || (i > 0 && offsets[i] < offsets[i - 1])) throw std::runtime_error("Corrupt transaction archive " + fpath);
+                }
+            }
+
+            size_t size() const {
+                return static_cast<size_t>(loadU64(file.data() + 8));
+            }
+
+            size_t blocks() const {
+                return offsets.size() - 1;
+            }
+
+            size_t accounts() const {
+                return dictionary.size();
+            }
+
+            const std::string& account(uint32_t index) const {
+                return dictionary[index];
+            }
+
+            // Decodes one block's columns without building transactions, e.g. for scans.
+            void decode(size_t block, ArchiveBlock& out) const {
+                Packing::Cursor in(file.data() + offsets[block], file.data() + offsets[block + 1]);
+                const size_t count = static_cast<size_t>(in.varint());
+                if (count > kArchiveBlockSize) throw std::runtime_error("Corrupt archive block");
+                getAccounts(in, count, dictionary.size(), out.senders);
+                getAccounts(in, count, dictionary.size(), out.receivers);
+
+                const uint64_t firstTimestamp = static_cast<uint64_t>(Packing::unzigzag(in.varint()));
+                const unsigned timeWidth = in.byte();
+                std::vector<uint64_t> values(count);
+                Packing::unpack(in.take(Packing::packedSize(count > 0 ? count - 1 : 0, timeWidth)), count > 0 ? count - 1 : 0, timeWidth, 0, values.data());
+                out.timestamps.resize(count);
+                uint64_t timestamp = firstTimestamp;
+                for (size_t i = 0; i < count; ++i) {
+                    if (i > 0) timestamp += static_cast<uint64_t>(Packing::unzigzag(values[i - 1]));
+                    out.timestamps[i] = static_cast<int64_t>(timestamp);
+                }
+
+                out.sums.resize(count);
+                const uint8_t decimals = in.byte();
+                if (decimals == 0xff) {
+                    const char* raw = in.take(count * 8);
+                    for (size_t i = 0; i < count; ++i) {
+                        uint64_t bits = loadU64(raw + i * 8);
+                        std::memcpy(&out.sums[i], &bits, sizeof(bits));
+                    }
+                }
+                else {
+                    if (decimals > kMaxDecimals) throw std::runtime_error("Corrupt archive block");
+                    const uint64_t low = static_cast<uint64_t>(Packing::unzigzag(in.varint()));
+                    const unsigned width = in.byte();
+                    Packing::unpack(in.take(Packing::packedSize(count, width)), count, width, low, values.data());
+                    const double scale = static_cast<double>(scaleOf(decimals));
+                    for (size_t i = 0; i < count; ++i) {
+                        out.sums[i] = static_cast<double>(static_cast<int64_t>(values[i])) / scale;
+                    }
+                }
+
+                out.ids.resize(static_cast<size_t>(in.varint()));
+                for (auto & id : out.ids) {
+                    id.first = static_cast<uint32_t>(in.varint());
+                    id.second = in.string();
+                    if (id.first >= count) throw std::runtime_error("Corrupt archive block");
+                }
+                if (!in.done()) throw std::runtime_error("Corrupt archive block");
+            }
+
+            // All transactions, decoded and hashed in parallel, in their original order.
+            VTransactions toTransactions() const {
+                VTransactions transactions(size());
+                std::vector<size_t> firsts(blocks() + 1, 0);
+                for (size_t b = 0; b < blocks(); ++b) {
+                    Packing::Cursor in(file.data() + offsets[b], file.data() + offsets[b + 1]);
+                    firsts[b + 1] = firsts[b] + static_cast<size_t>(in.varint());
+                }
+                if (firsts.back() != transactions.size()) throw std::runtime_error("Corrupt transaction archive");
+
+                const long count = static_cast<long>(blocks());
+#pragma omp parallel for schedule(dynamic, 1)
+                for (long b = 0; b < count; ++b) {
+                    ArchiveBlock columns;
+                    decode(b, columns);
+                    for (size_t i = 0; i < columns.size(); ++i) {
+                        VTransaction& transaction = transactions[firsts[b] + i];
+                        transaction.assign(dictionary[columns.senders[i]], dictionary[columns.receivers[i]], columns.sums[i],
+                                           static_cast<time_t>(columns.timestamps[i]));
+                        transaction.id = transaction.hashHex();
+                    }
+                    for (auto & id : columns.ids) {
+                        transactions[firsts[b] + id.first].id = id.second;
+                    }
+                }
+                return transactions;
+            }
+
+            // Encodes the transactions; blocks are encoded in parallel and the file is
+            // replaced atomically. Returns the archive's size in bytes.
+            static size_t write(const std::string& fpath, const VTransactions& transactions) {
+                std::unordered_map<std::string, uint32_t> accounts;
+                std::string dictionaryBytes;
+                auto addAccount = [&](const std::string& key) {
+                    if (!accounts.emplace(key, static_cast<uint32_t>(accounts.size())).second) return;
+                    bc::hash_digest digest;
+                    if (decodeHash(key, digest) && bc::encode_base16(digest) == key) {
+                        dictionaryBytes.push_back('\0');
+                        dictionaryBytes.append(reinterpret_cast<const char*>(digest.data()), digest.size());
+                    }
+                    else {
+                        dictionaryBytes.push_back('\1');
+                        Packing::putVarint(dictionaryBytes, key.size());
+                        dictionaryBytes += key;
+                    }
+                };
+                for (const auto & transaction : transactions) {
+                    addAccount(transaction.sender());
+                    addAccount(transaction.receiver());
+                }
+
+                const size_t blocks = (transactions.size() + kArchiveBlockSize - 1) / kArchiveBlockSize;
+                std::vector<std::string> encoded(blocks);
+                const long count = static_cast<long>(blocks);
+#pragma omp parallel for schedule(dynamic, 1)
+                for (long b = 0; b < count; ++b) {
+                    const size_t first = b * kArchiveBlockSize;
+                    encoded[b] = encodeBlock(transactions, first, std::min(kArchiveBlockSize, transactions.size() - first), accounts);
+                }
+
+                std::string contents(kHeaderSize, '\0');
+                contents += dictionaryBytes;
+                std::vector<uint64_t> index;
+                for (const auto & block : encoded) {
+                    index.push_back(contents.size());
+                    contents += block;
+                }
+                index.push_back(contents.size());
+                const uint64_t indexOffset = contents.size();
+                contents.resize(contents.size() + index.size() * 8);
+                for (size_t i = 0; i < index.size(); ++i) storeU64(&contents[indexOffset + i * 8], index[i]);
+
+                char* header = &contents[0];
+                storeU32(header, kMagic);
+                storeU32(header + 4, kVersion);
+                storeU64(header + 8, transactions.size());
+                storeU32(header + 16, static_cast<uint32_t>(blocks));
+                storeU32(header + 20, static_cast<uint32_t>(accounts.size()));
+                storeU64(header + 24, kHeaderSize);
+                storeU64(header + 32, indexOffset);
+                storeU64(header + 40, fnv1a(kFnvOffsetBasis, header + kHeaderSize, contents.size() - kHeaderSize));
+                writeFileAtomically(fpath, contents);
+                return contents.size();
+            }
+        };
+
+        size_t writeTransactionArchive(const std::string& fpath, const VTransactions& transactions) {
+            return TransactionArchive::write(fpath, transactions);
+        }
+
+        VTransactions getTransactionsFromArchive(const std::string& fpath) {
+            return TransactionArchive(fpath).toTransactions();
+        }
+    } }
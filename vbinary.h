@@ -0,0 +1,226 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include "vcoin.h"
+#include "vfile.h"
+
+namespace VCoin { namespace IO
+    {
+        // Fixed-size records shared by the binary data files and ledger snapshots. Strings
+        // are NUL-padded to their field width; doubles are stored as their IEEE-754 bits.
+        const size_t kUserKeySize = 64;
+        const size_t kUserNameSize = 32;
+        const size_t kUserRecordSize = kUserKeySize + kUserNameSize + 8;                  // key, name, balance
+        const size_t kTransactionIdSize = 64;
+        const size_t kTransactionRecordSize = kTransactionIdSize + 2 * kUserKeySize + 16; // id, sender, receiver, sum, timestamp
+
+        void storeField(char* at, const std::string& value, size_t width, const char* what) {
+            if (value.size() > width) throw std::length_error(std::string(what) + " too long for a binary record: " + value);
+            std::memcpy(at, value.data(), value.size());
+        }
+
+        std::string loadField(const char* at, size_t width) {
+            return std::string(at, std::find(at, at + width, '\0'));
+        }
+
+        void storeDouble(char* at, double value) {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            storeU64(at, bits);
+        }
+
+        double loadDouble(const char* at) {
+            uint64_t bits = loadU64(at);
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        // The record must be zeroed beforehand.
+        void storeUserRecord(char* at, const VUser& user) {
+            storeField(at, user.key, kUserKeySize, "User key");
+            storeField(at + kUserKeySize, user.name, kUserNameSize, "User name");
+            storeDouble(at + kUserKeySize + kUserNameSize, user.balance);
+        }
+
+        VUser loadUserRecord(const char* at) {
+            VUser user;
+            user.key = loadField(at, kUserKeySize);
+            user.name = loadField(at + kUserKeySize, kUserNameSize);
+            user.balance = loadDouble(at + kUserKeySize + kUserNameSize);
+            return user;
+        }
+
+        // The record must be zeroed beforehand.
+        void storeTransactionRecord(char* at, const VTransaction& transaction) {
+            storeField(at, transaction.id, kTransactionIdSize, "Transaction id");
+            at += kTransactionIdSize;
+            storeField(at, transaction.sender(), kUserKeySize, "Sender key");
+            storeField(at + kUserKeySize, transaction.receiver(), kUserKeySize, "Receiver key");
+            at += 2 * kUserKeySize;
+            storeDouble(at, transaction.sum());
+            storeU64(at + 8, static_cast<uint64_t>(static_cast<int64_t>(transaction.timestamp())));
+        }
+
+        // Constructing the transaction hashes its body.
+        VTransaction loadTransactionRecord(const char* at) {
+            std::string id = loadField(at, kTransactionIdSize);
+            at += kTransactionIdSize;
+            std::string sender = loadField(at, kUserKeySize);
+            std::string receiver = loadField(at + kUserKeySize, kUserKeySize);
+            at += 2 * kUserKeySize;
+            double sum = loadDouble(at);
+            time_t timestamp = static_cast<time_t>(static_cast<int64_t>(loadU64(at + 8)));
+            return VTransaction(std::move(sender), std::move(receiver), sum, timestamp, std::move(id));
+        }
+
+        // A versioned binary data file: a 32-byte header { magic, version, count, record
+        // size } followed by count fixed-size records, so it can be mapped and read in place.
+        class RecordFile
+        {
+        public:
+            static const size_t kHeaderSize = 32;
+            static const uint32_t kVersion = 1;
+
+        private:
+            MappedFile file;
+            size_t recordSize;
+
+        public:
+            // Throws std::runtime_error if the file is missing or not of the expected kind.
+            RecordFile(const std::string& fpath, uint32_t magic, size_t recordSize) : file(fpath), recordSize(recordSize) {
+                const char* data = file.data();
+                if (file.size() < kHeaderSize || loadU32(data) != magic || loadU32(data + 4) != kVersion || loadU32(data + 16) != recordSize) {
+                    throw std::runtime_error("Unrecognized binary file " + fpath);
+                }
+                if (file.size() != kHeaderSize + size() * recordSize) throw std::runtime_error("Truncated binary file " + fpath);
+            }
+
+            size_t size() const {
+                return static_cast<size_t>(loadU64(file.data() + 8));
+            }
+
+            const char* record(size_t i) const {
+                return file.data() + kHeaderSize + i * recordSize;
+            }
+
+            // An empty file image with room for count zeroed records.
+            static std::string create(uint32_t magic, size_t recordSize, size_t count) {
+                std::string contents(kHeaderSize + count * recordSize, '\0');
+                storeU32(&contents[0], magic);
+                storeU32(&contents[4], kVersion);
+                storeU64(&contents[8], count);
+                storeU32(&contents[16], static_cast<uint32_t>(recordSize));
+                return contents;
+            }
+        };
+
+        // users.bin, mapped; users are in key order.
+        class UserFile
+        {
+        private:
+            RecordFile records;
+
+        public:
+            static const uint32_t kMagic = 0x52535556; // "VUSR"
+
+            explicit UserFile(const std::string& fpath) : records(fpath, kMagic, kUserRecordSize) {}
+
+            size_t size() const { return records.size(); }
+            VUser user(size_t i) const { return loadUserRecord(records.record(i)); }
+            std::string key(size_t i) const { return loadField(records.record(i), kUserKeySize); }
+            double balance(size_t i) const { return loadDouble(records.record(i) + kUserKeySize + kUserNameSize); }
+        };
+
+        // transactions.bin, mapped.
+        class TransactionFile
+        {
+        private:
+            RecordFile records;
+
+        public:
+            static const uint32_t kMagic = 0x4e585456; // "VTXN"
+
+            explicit TransactionFile(const std::string& fpath) : records(fpath, kMagic, kTransactionRecordSize) {}
+
+            size_t size() const { return records.size(); }
+            VTransaction transaction(size_t i) const { return loadTransactionRecord(records.record(i)); }
+            std::string id(size_t i) const { return loadField(records.record(i), kTransactionIdSize); }
+            double sum(size_t i) const { return loadDouble(records.record(i) + kTransactionIdSize + 2 * kUserKeySize); }
+            time_t timestamp(size_t i) const { return static_cast<time_t>(static_cast<int64_t>(loadU64(records.record(i) + kTransactionIdSize + 2 * kUserKeySize + 8))); }
+        };
+
+        VUsers getUsersFromBinaryFile(const std::string& fpath) {
+            UserFile file(fpath);
+            VUsers users;
+            for (size_t i = 0; i < file.size(); ++i) {
+                VUser user = file.user(i);
+                users.emplace_hint(users.end(), user.key, user);
+            }
+            return users;
+        }
+
+        VTransactions getTransactionsFromBinaryFile(const std::string& fpath) {
+            TransactionFile file(fpath);
+            VTransactions transactions(file.size());
+            const long count = static_cast<long>(file.size());
+#pragma omp parallel for schedule(dynamic, 64)
+            for (long i = 0; i < count; ++i) {
+                transactions[i] = file.transaction(i);
+            }
+            return transactions;
+        }
+
+        // Binary files are replaced atomically.
+        void writeUsersToBinaryFile(const std::string& fpath, const VUsers& users) {
+            std::string contents = RecordFile::create(UserFile::kMagic, kUserRecordSize, users.size());
+            char* record = &contents[RecordFile::kHeaderSize];
+            for (const auto & user : users) {
+                storeUserRecord(record, user.second);
+                record += kUserRecordSize;
+            }
+            writeFileAtomically(fpath, contents);
+        }
+
+        // Calls forEach(callback) to enumerate count transactions, e.g. a container's or a
+        // Mempool's contents.
+        template <typename ForEach>
+        void writeTransactionRecords(const std::string& fpath, size_t count, ForEach forEach) {
+            std::string contents = RecordFile::create(TransactionFile::kMagic, kTransactionRecordSize, count);
+            char* record = &contents[RecordFile::kHeaderSize];
+            size_t written = 0;
+            forEach([&](const VTransaction& transaction) {
+                if (written++ == count) throw std::logic_error("More transactions than announced");
+                storeTransactionRecord(record, transaction);
+                record += kTransactionRecordSize;
+            });
+            if (written != count) throw std::logic_error("Fewer transactions than announced");
+            writeFileAtomically(fpath, contents);
+        }
+
+        void writeTransactionsToBinaryFile(const std::string& fpath, const VTransactions& transactions) {
+            writeTransactionRecords(fpath, transactions.size(), [&transactions](const std::function<void(const VTransaction&)>& callback) {
+                for (const auto & transaction : transactions) callback(transaction);
+            });
+        }
+
+        // Converters between the text and binary formats; records keep their order.
+        void usersTextToBinary(const std::string& textPath, const std::string& binaryPath) {
+            writeUsersToBinaryFile(binaryPath, getUsersFromFile(textPath));
+        }
+
+        void usersBinaryToText(const std::string& binaryPath, const std::string& textPath) {
+            writeUsersToFile(textPath, getUsersFromBinaryFile(binaryPath));
+        }
+
+        void transactionsTextToBinary(const std::string& textPath, const std::string& binaryPath) {
+            writeTransactionsToBinaryFile(binaryPath, getTransactionsFromFile(textPath));
+        }
+
+        void transactionsBinaryToText(const std::string& binaryPath, const std::string& textPath) {
+            writeTransactionsToFile(textPath, getTransactionsFromBinaryFile(binaryPath));
+        }
+    } }
@@ -11,7 +11,24 @@
 #include <fstream>
 #include <sstream>
 #include <deque>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <functional>
+#include <cstring>
+#include <limits>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <stdexcept>
+#include <cmath>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
+#include <chrono>
+#include <omp.h>
 #include "vhasher.h"
+#include "vfile.h"
 #include <bitcoin/bitcoin.hpp>
 
 
@@ -29,44 +46,266 @@ namespace VCoin
         double balance;
     };
 
-    struct VTransaction {
+    // Canonical binary encoding used for hashing and storage: fixed-width little-endian
+    // integers, doubles as their IEEE-754 bit pattern and strings prefixed by a u32 length.
+    // Writers append to a caller-provided buffer so it can be reused without reallocating.
+    namespace Serial
+    {
+        const size_t kStringPrefixSize = sizeof(uint32_t);
+
+        void putU8(std::string& out, uint8_t value) {
+            out.push_back(static_cast<char>(value));
+        }
+
+        void putU32(std::string& out, uint32_t value) {
+            for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>((value >> (8*i)) & 0xff));
+        }
+
+        void putU64(std::string& out, uint64_t value) {
+            for (int i = 0; i < 8; ++i) out.push_back(static_cast<char>((value >> (8*i)) & 0xff));
+        }
+
+        void putI64(std::string& out, int64_t value) {
+            putU64(out, static_cast<uint64_t>(value));
+        }
+
+        void putDouble(std::string& out, double value) {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            putU64(out, bits);
+        }
+
+        void putString(std::string& out, const std::string& value) {
+            putU32(out, static_cast<uint32_t>(value.size()));
+            out.append(value);
+        }
+
+        size_t stringSize(const std::string& value) {
+            return kStringPrefixSize + value.size();
+        }
+
+        // Bounds-checked reader over a serialized buffer; throws std::runtime_error when a
+        // field would run past the end.
+        class Reader
+        {
+        private:
+            const char* data;
+            size_t size;
+            size_t pos = 0;
+
+            const char* take(size_t length) {
+                if (length > size - pos) throw std::runtime_error("Serialized data is truncated");
+                const char* field = data + pos;
+                pos += length;
+                return field;
+            }
+
+            uint64_t getLE(size_t width) {
+                const unsigned char* bytes = reinterpret_cast<const unsigned char*>(take(width));
+                uint64_t value = 0;
+                for (size_t i = 0; i < width; ++i) value |= static_cast<uint64_t>(bytes[i]) << (8*i);
+                return value;
+            }
+
+        public:
+            Reader(const char* data, size_t size) : data(data), size(size) {}
+
+            uint8_t getU8() { return static_cast<uint8_t>(getLE(1)); }
+            uint32_t getU32() { return static_cast<uint32_t>(getLE(4)); }
+            uint64_t getU64() { return getLE(8); }
+            int64_t getI64() { return static_cast<int64_t>(getLE(8)); }
+
+            double getDouble() {
+                uint64_t bits = getLE(8);
+                double value;
+                std::memcpy(&value, &bits, sizeof(value));
+                return value;
+            }
+
+            std::string getString() {
+                uint32_t length = getU32();
+                return std::string(take(length), length);
+            }
+
+            size_t remaining() const {
+                return size - pos;
+            }
+        };
+
+        // Per-thread scratch buffer for callers that serialize only to hash the result.
+        std::string& scratchBuffer() {
+            static thread_local std::string buffer;
+            buffer.clear();
+            return buffer;
+        }
+    }
+
+    // Decodes a hex digest as produced by VHasher::getHash into its binary form.
+    // Returns false if the input is not a well-formed 32-byte digest.
+    bool decodeHash(const std::string& hex, bc::hash_digest& out) {
+        if (hex.size() != 2 * out.size()) return false;
+        auto nibble = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        };
+        for (size_t i = 0; i < out.size(); ++i) {
+            int hi = nibble(hex[2*i]), lo = nibble(hex[2*i+1]);
+            if (hi < 0 || lo < 0) return false;
+            out[i] = static_cast<uint8_t>((hi << 4) | lo);
+        }
+        return true;
+    }
+
+    // A transaction carries the binary hash of its body, computed once when the body is
+    // assigned. The body is only reachable through setters, so any mutation rehashes and a
+    // cached hash can never go stale. id is the hash claimed by whoever created the
+    // transaction and is checked against the real one by hasValidId().
+    class VTransaction {
+    private:
+        std::string _sender;
+        std::string _receiver;
+        double _sum = 0;
+        time_t _timestamp = 0;
+        bc::hash_digest _hash = bc::null_hash;
+
+        void rehash() {
+            std::string& buffer = Serial::scratchBuffer();
+            buffer.reserve(serializedSize());
+            serialize(buffer);
+            decodeHash(VHasher::getHash(buffer), _hash);
+        }
+
+    public:
         std::string id;
-        std::string sender;
-        std::string receiver;
-        double sum;
-        time_t timestamp;
 
-        std::string toHex() {
-            std::stringstream transHexStream;
-            transHexStream << sender << receiver << sum << timestamp;
-            return transHexStream.str();
+        // A default-constructed transaction holds a null hash until its body is assigned.
+        VTransaction() {}
+
+        VTransaction(std::string sender, std::string receiver, double sum, time_t timestamp, std::string id = "")
+                : _sender(std::move(sender)), _receiver(std::move(receiver)), _sum(sum), _timestamp(timestamp), id(std::move(id)) {
+            rehash();
+        }
+
+        const std::string& sender() const { return _sender; }
+        const std::string& receiver() const { return _receiver; }
+        double sum() const { return _sum; }
+        time_t timestamp() const { return _timestamp; }
+        const bc::hash_digest& hash() const { return _hash; }
+
+        std::string hashHex() const {
+            return bc::encode_base16(_hash);
+        }
+
+        bool hasValidId() const {
+            bc::hash_digest claimed;
+            return decodeHash(id, claimed) && claimed == _hash;
+        }
+
+        // Ids from before the binary encoding hashed the fields streamed as text. Data files
+        // written then carry such ids, which would all fail hasValidId(); one that is valid
+        // under the old rule is replaced by the current id. Returns whether the id is valid now.
+        bool upgradeLegacyId() {
+            if (hasValidId()) return true;
+            std::ostringstream legacy;
+            legacy << _sender << _receiver << _sum << _timestamp;
+            if (VHasher::getHash(legacy.str()) != id) return false;
+            id = hashHex();
+            return true;
+        }
+
+        void setSender(const std::string& sender) { _sender = sender; rehash(); }
+        void setReceiver(const std::string& receiver) { _receiver = receiver; rehash(); }
+        void setSum(double sum) { _sum = sum; rehash(); }
+        void setTimestamp(time_t timestamp) { _timestamp = timestamp; rehash(); }
+
+        void assign(const std::string& sender, const std::string& receiver, double sum, time_t timestamp) {
+            _sender = sender;
+            _receiver = receiver;
+            _sum = sum;
+            _timestamp = timestamp;
+            rehash();
+        }
+
+        size_t serializedSize() const {
+            return Serial::stringSize(_sender) + Serial::stringSize(_receiver) + sizeof(double) + sizeof(int64_t);
+        }
+
+        void serialize(std::string& out) const {
+            Serial::putString(out, _sender);
+            Serial::putString(out, _receiver);
+            Serial::putDouble(out, _sum);
+            Serial::putI64(out, static_cast<int64_t>(_timestamp));
+        }
+
+        // Only validated transactions are serialized, so the id is restored from the hash.
+        static VTransaction deserialize(Serial::Reader& in) {
+            std::string sender = in.getString();
+            std::string receiver = in.getString();
+            double sum = in.getDouble();
+            time_t timestamp = static_cast<time_t>(in.getI64());
+            VTransaction transaction(std::move(sender), std::move(receiver), sum, timestamp);
+            transaction.id = transaction.hashHex();
+            return transaction;
         }
     };
 
-    struct VBlock {
+    // The block id is the hash of the header alone; the transactions are committed to
+    // through merkleRootHash, so mining only rehashes a short fixed layout.
+    struct VBlockHeader {
         std::string prevBlock;
-        time_t timeStamp;
+        time_t timeStamp = 0;
         std::string version = "v0.1";
         std::string merkleRootHash;
-        VTransactions transactions;
         uint64_t nonce = 0;
         uint8_t diffTarget = VCoin::kCurrentDifficulty;
 
-        std::string toHex()
-        {
-            std::stringstream blockHexStream;
-            blockHexStream << std::hex << prevBlock << timeStamp << version << merkleRootHash;
-            for (auto & transaction : transactions) {
-                blockHexStream << transaction.toHex();
-            }
-            blockHexStream << nonce << diffTarget;
+        // Size of the fields preceding timeStamp; mining rewrites only what follows.
+        size_t serializedPrefixSize() const {
+            return Serial::stringSize(version) + Serial::stringSize(prevBlock) + Serial::stringSize(merkleRootHash);
+        }
+
+        size_t serializedHeaderSize() const {
+            return serializedPrefixSize() + sizeof(int64_t) + sizeof(uint64_t) + sizeof(uint8_t);
+        }
+
+        void serializePrefix(std::string& out) const {
+            Serial::putString(out, version);
+            Serial::putString(out, prevBlock);
+            Serial::putString(out, merkleRootHash);
+        }
+
+        void serializeSuffix(std::string& out) const {
+            Serial::putI64(out, static_cast<int64_t>(timeStamp));
+            Serial::putU64(out, nonce);
+            Serial::putU8(out, diffTarget);
+        }
+
+        void serializeHeader(std::string& out) const {
+            serializePrefix(out);
+            serializeSuffix(out);
+        }
 
-            return blockHexStream.str();
+        void deserializeHeader(Serial::Reader& in) {
+            version = in.getString();
+            prevBlock = in.getString();
+            merkleRootHash = in.getString();
+            timeStamp = static_cast<time_t>(in.getI64());
+            nonce = in.getU64();
+            diffTarget = in.getU8();
         }
 
-        void printHeader()
+        std::string hash() const {
+            std::string& buffer = Serial::scratchBuffer();
+            buffer.reserve(serializedHeaderSize());
+            serializeHeader(buffer);
+            return VHasher::getHash(buffer);
+        }
+
+        void printHeader() const
         {
-            std::cout << "Block hash: " << VHasher::getHash(toHex()) << "\n";
+            std::cout << "Block hash: " << hash() << "\n";
             std::cout << "Previous block hash: " << prevBlock << "\n";
             std::cout << "Timestamp (unix time): " << timeStamp << "\n";
             std::cout << "Version: " << version << "\n";
@@ -76,6 +315,37 @@ namespace VCoin
         }
     };
 
+    struct VBlock : public VBlockHeader {
+        VTransactions transactions;
+
+        size_t serializedSize() const {
+            size_t size = serializedHeaderSize() + sizeof(uint32_t);
+            for (auto & transaction : transactions) {
+                size += transaction.serializedSize();
+            }
+            return size;
+        }
+
+        // Header followed by the transaction count and the transaction bodies.
+        void serialize(std::string& out) const {
+            serializeHeader(out);
+            Serial::putU32(out, static_cast<uint32_t>(transactions.size()));
+            for (auto & transaction : transactions) {
+                transaction.serialize(out);
+            }
+        }
+
+        static VBlock deserialize(Serial::Reader& in) {
+            VBlock block;
+            block.deserializeHeader(in);
+            uint32_t count = in.getU32();
+            for (uint32_t i = 0; i < count; ++i) {
+                block.transactions.push_back(VTransaction::deserialize(in));
+            }
+            return block;
+        }
+    };
+
     bool compareTransactions(const VTransaction& a, const VTransaction& b) {
         return a.id > b.id;
     }
@@ -131,7 +401,7 @@ namespace VCoin
         std::sort(transSorted.begin(), transSorted.end(), compareTransactions);
         std::deque<std::string> merkleTree;
         for (auto & it : transSorted) {
-            merkleTree.push_back(VHasher::getHash(it.toHex()));
+            merkleTree.push_back(it.hashHex());
         }
 
         while (merkleTree.size() != 1) {
@@ -159,29 +429,143 @@ namespace VCoin
             std::uniform_int_distribution<int> transDist(0, transactions.size()-1);
             uint32_t randIndex = transDist(generator);
 
-            if (tmpUsers[transactions[randIndex].sender].balance >= transactions[randIndex].sum) {
+            if (tmpUsers[transactions[randIndex].sender()].balance >= transactions[randIndex].sum()) {
                 block.transactions.push_back(transactions[randIndex]);
-                tmpUsers[transactions[randIndex].sender].balance -= transactions[randIndex].sum;
-                tmpUsers[transactions[randIndex].receiver].balance += transactions[randIndex].sum;
+                tmpUsers[transactions[randIndex].sender()].balance -= transactions[randIndex].sum();
+                tmpUsers[transactions[randIndex].receiver()].balance += transactions[randIndex].sum();
             }
 
             transactions.erase(transactions.begin() + randIndex);
         }
     }
 
-    void validateTransactions(VTransactions& transactions) {
-        for (int i = 0; i < transactions.size(); ++i) {
-            if (transactions[i].id != VHasher::getHash(transactions[i].toHex())) {
-                std::cout << "Invalid transaction found!\nProvided hash:\t" + transactions[i].id + "\nShould be:\t" + VHasher::getHash(transactions[i].toHex()) + "\n\n";
-                transactions.erase(transactions.begin() + i);
-            }
+    // Moves the transactions flagged valid to the front, keeping their order, and drops
+    // the rest. Returns the number removed.
+    size_t compactValidTransactions(VTransactions& transactions, const std::vector<char>& valid) {
+        size_t kept = 0;
+        for (size_t i = 0; i < transactions.size(); ++i) {
+            if (!valid[i]) continue;
+            if (kept != i) transactions[kept] = std::move(transactions[i]);
+            ++kept;
         }
+        size_t removed = transactions.size() - kept;
+        transactions.erase(transactions.begin() + kept, transactions.end());
+        return removed;
     }
 
-    void updateUsersBalance(VUsers& users, const VTransactions& transactions) {
+    void reportInvalidTransaction(const VTransaction& transaction) {
+        std::string message = "Invalid transaction found!\nProvided hash:\t" + transaction.id + "\nShould be:\t" + transaction.hashHex() + "\n\n";
+#pragma omp critical(vcoin_log)
+        std::cout << message;
+    }
+
+    // Checks transaction ids in parallel, then compacts the invalid transactions out in a
+    // single stable pass. The memoized hash makes each check a 32-byte compare, cheaper
+    // than any lookup that would remember verified ids.
+    // Returns the number of transactions removed.
+    size_t validateTransactions(VTransactions& transactions) {
+        const long count = static_cast<long>(transactions.size());
+        std::vector<char> valid(transactions.size(), 0);
+
+#pragma omp parallel for schedule(static)
+        for (long i = 0; i < count; ++i) {
+            if (transactions[i].hasValidId()) valid[i] = 1;
+            else reportInvalidTransaction(transactions[i]);
+        }
+
+        return compactValidTransactions(transactions, valid);
+    }
+
+    // Blocks smaller than this are applied serially; grouping costs more than it saves.
+    const size_t kParallelBalanceThreshold = 2048;
+
+    void updateUsersBalanceSerial(VUsers& users, const VTransactions& transactions) {
         for (const auto & transaction : transactions) {
-            users[transaction.sender].balance -= transaction.sum;
-            users[transaction.receiver].balance += transaction.sum;
+            users[transaction.sender()].balance -= transaction.sum();
+            users[transaction.receiver()].balance += transaction.sum();
+        }
+    }
+
+    // Transactions that touch disjoint accounts commute, so the block is partitioned into
+    // groups of transactions connected through shared accounts. Groups are applied
+    // concurrently and each group keeps block order, so every account sees its updates in
+    // the same order as a serial pass and ends with the same balance bit for bit. Only
+    // blocks of kParallelBalanceThreshold or more transactions are grouped, far above the
+    // default block size, and the groups only run in parallel when called outside another
+    // parallel region, since nested regions get a single thread.
+    void updateUsersBalance(VUsers& users, const VTransactions& transactions) {
+        if (transactions.size() < kParallelBalanceThreshold) {
+            updateUsersBalanceSerial(users, transactions);
+            return;
+        }
+
+        // Resolve every touched account up front. Missing accounts are inserted here, so the
+        // map is not restructured while groups run and the balance pointers stay valid.
+        std::unordered_map<std::string, size_t> accountIndex;
+        std::vector<double*> balances;
+        std::vector<size_t> parent;
+        auto indexOf = [&](const std::string& key) -> size_t {
+            auto it = accountIndex.find(key);
+            if (it != accountIndex.end()) return it->second;
+            size_t index = balances.size();
+            accountIndex.emplace(key, index);
+            balances.push_back(&users[key].balance);
+            parent.push_back(index);
+            return index;
+        };
+        auto find = [&parent](size_t account) -> size_t {
+            while (parent[account] != account) {
+                parent[account] = parent[parent[account]];
+                account = parent[account];
+            }
+            return account;
+        };
+
+        const size_t count = transactions.size();
+        std::vector<size_t> senders(count), receivers(count);
+        for (size_t i = 0; i < count; ++i) {
+            senders[i] = indexOf(transactions[i].sender());
+            receivers[i] = indexOf(transactions[i].receiver());
+            size_t a = find(senders[i]), b = find(receivers[i]);
+            if (a != b) parent[std::max(a, b)] = std::min(a, b);
+        }
+
+        // Bucket the transactions by group with a stable counting sort.
+        std::vector<size_t> groupOf(balances.size(), SIZE_MAX);
+        std::vector<size_t> groupStart;
+        std::vector<size_t> txGroup(count);
+        for (size_t i = 0; i < count; ++i) {
+            size_t root = find(senders[i]);
+            if (groupOf[root] == SIZE_MAX) {
+                groupOf[root] = groupStart.size();
+                groupStart.push_back(0);
+            }
+            txGroup[i] = groupOf[root];
+            groupStart[txGroup[i]]++;
+        }
+        const size_t groups = groupStart.size();
+        size_t offset = 0;
+        for (size_t g = 0; g < groups; ++g) {
+            size_t size = groupStart[g];
+            groupStart[g] = offset;
+            offset += size;
+        }
+        groupStart.push_back(count);
+        std::vector<size_t> ordered(count);
+        std::vector<size_t> cursor(groupStart.begin(), groupStart.end() - 1);
+        for (size_t i = 0; i < count; ++i) {
+            ordered[cursor[txGroup[i]]++] = i;
+        }
+
+        const long groupCount = static_cast<long>(groups);
+#pragma omp parallel for schedule(dynamic, 1)
+        for (long g = 0; g < groupCount; ++g) {
+            for (size_t k = groupStart[g]; k < groupStart[g+1]; ++k) {
+                size_t i = ordered[k];
+                double sum = transactions[i].sum();
+                *balances[senders[i]] -= sum;
+                *balances[receivers[i]] += sum;
+            }
         }
     }
 
@@ -192,72 +576,793 @@ namespace VCoin
         return true;
     }
 
-    class BlockChain
+    typedef std::shared_ptr<const VBlock> VBlockHandle;
+    typedef std::shared_ptr<const VBlockHeader> VHeaderHandle;
+
+    // Thrown when the body of a pruned block is requested; its header is still available.
+    class BlockPrunedError : public std::out_of_range
+    {
+    public:
+        explicit BlockPrunedError(const std::string& hash) : std::out_of_range("Block " + hash + " has been pruned") {}
+    };
+
+    // Where block bodies that are not resident in memory come from, e.g. a BlockStore.
+    class BlockSource
+    {
+    public:
+        virtual ~BlockSource() {}
+
+        // Throws std::out_of_range if the block is not available.
+        virtual VBlockHandle load(const std::string& hash) const = 0;
+    };
+
+    const size_t kDefaultBlockCacheBytes = 64 * 1024 * 1024;
+
+    struct BlockCacheStats {
+        size_t blocks = 0;
+        size_t bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    // Size-bounded LRU cache of block bodies in front of a BlockSource. Without a source it
+    // holds the only copy of every body and never evicts. Returned handles keep a body
+    // alive after it is evicted. Thread-safe; loads happen outside the lock.
+    class BlockCache
     {
     private:
-        std::map<std::string, VBlock> blockChain;
-        std::string chainHead;
-        size_t _size;
+        struct Entry {
+            std::string hash;
+            VBlockHandle block;
+            size_t bytes;
+        };
+
+        const BlockSource* source;
+        size_t maxBytes;
+        mutable std::mutex mutex;
+        std::list<Entry> recent; // most recently used first
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        BlockCacheStats _stats;
+
+        static size_t blockBytes(const VBlock& block) {
+            return sizeof(VBlock) + block.transactions.size() * sizeof(VTransaction) + block.serializedSize();
+        }
+
+        void insertLocked(const std::string& hash, const VBlockHandle& block) {
+            auto it = index.find(hash);
+            if (it != index.end()) {
+                recent.splice(recent.begin(), recent, it->second);
+                return;
+            }
+            size_t bytes = blockBytes(*block);
+            recent.push_front(Entry{hash, block, bytes});
+            index[hash] = recent.begin();
+            _stats.bytes += bytes;
+            while (source != nullptr && _stats.bytes > maxBytes && recent.size() > 1) {
+                const Entry& victim = recent.back();
+                _stats.bytes -= victim.bytes;
+                index.erase(victim.hash);
+                recent.pop_back();
+                _stats.evictions++;
+            }
+            _stats.blocks = index.size();
+        }
 
     public:
-        BlockChain(VBlock genesis) {
-            if (!hashMeetsTarget(VHasher::getHash(genesis.toHex()), genesis.diffTarget)) throw;
+        explicit BlockCache(const BlockSource* source = nullptr, size_t maxBytes = kDefaultBlockCacheBytes)
+                : source(source), maxBytes(maxBytes) {}
+
+        void put(const std::string& hash, const VBlockHandle& block) {
+            std::lock_guard<std::mutex> lock(mutex);
+            insertLocked(hash, block);
+        }
 
-            std::string hash = VHasher::getHash(genesis.toHex());
-            blockChain[hash] = genesis;
-            chainHead = hash;
-            _size = 1;
+        // Throws std::out_of_range if the body is neither cached nor available from the source.
+        VBlockHandle get(const std::string& hash) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = index.find(hash);
+                if (it != index.end()) {
+                    recent.splice(recent.begin(), recent, it->second);
+                    _stats.hits++;
+                    return it->second->block;
+                }
+                _stats.misses++;
+                if (source == nullptr) throw std::out_of_range("Block body " + hash + " is not available");
+            }
+            VBlockHandle block = source->load(hash);
+            std::lock_guard<std::mutex> lock(mutex);
+            insertLocked(hash, block);
+            return block;
         }
 
-        size_t size() {
+        void erase(const std::string& hash) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(hash);
+            if (it == index.end()) return;
+            _stats.bytes -= it->second->bytes;
+            recent.erase(it->second);
+            index.erase(it);
+            _stats.blocks = index.size();
+        }
+
+        BlockCacheStats stats() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return _stats;
+        }
+    };
+
+    class BlockChain;
+
+    // Immutable view of the chain at one point in time. Headers are stored by height in
+    // fixed-size segments and hashes in a sharded hash->height index; bodies are fetched
+    // on demand through the chain's BlockCache. Snapshots share
+    // full segments and untouched index shards with their successors, so publishing a
+    // new one costs O(size / kSegmentSize + size / kIndexShards) rather than a full copy.
+    // References returned by a snapshot stay valid for as long as the snapshot is held.
+    class ChainSnapshot
+    {
+    private:
+        friend class BlockChain;
+
+        static const size_t kSegmentSize = 1024;
+        static const size_t kIndexShards = 256;
+
+        struct Entry {
+            std::string hash;
+            VHeaderHandle header;
+        };
+
+        // Slots past a snapshot's size are invisible to it, so the writer may fill them in
+        // place while older snapshots are being read. filled is the writer's high-water mark:
+        // a slot below it may be visible to some snapshot and is only rewritten in a copy.
+        struct Segment {
+            std::vector<Entry> entries = std::vector<Entry>(kSegmentSize);
+            size_t filled = 0;
+        };
+
+        typedef std::unordered_map<std::string, size_t> IndexShard;
+
+        std::vector<std::shared_ptr<Segment>> segments;
+        std::vector<std::shared_ptr<const IndexShard>> index = std::vector<std::shared_ptr<const IndexShard>>(kIndexShards);
+        size_t _size = 0;
+        size_t _pruned = 0;
+        std::shared_ptr<BlockCache> bodies;
+
+        static size_t shardOf(const std::string& hash) {
+            return std::hash<std::string>()(hash) % kIndexShards;
+        }
+
+        const Entry& entry(size_t height) const {
+            if (height >= _size) throw std::out_of_range("Block height " + std::to_string(height) + " is past the chain head");
+            return segments[height / kSegmentSize]->entries[height % kSegmentSize];
+        }
+
+    public:
+        size_t size() const {
             return _size;
         }
 
-        std::string head() {
-            return this->chainHead;
+        const std::string& head() const {
+            return entry(_size - 1).hash;
+        }
+
+        // Bodies below this height have been pruned; their headers remain.
+        size_t prunedHeight() const {
+            return _pruned;
+        }
+
+        bool contains(const std::string& hash) const {
+            const auto& shard = index[shardOf(hash)];
+            return shard && shard->count(hash) != 0;
+        }
+
+        // Throws std::out_of_range for unknown hashes.
+        size_t heightOf(const std::string& hash) const {
+            const auto& shard = index[shardOf(hash)];
+            if (!shard) throw std::out_of_range("Unknown block " + hash);
+            auto it = shard->find(hash);
+            if (it == shard->end()) throw std::out_of_range("Unknown block " + hash);
+            return it->second;
+        }
+
+        const std::string& hashAt(size_t height) const {
+            return entry(height).hash;
         }
 
-        VBlock get(const std::string& hash) {
-            return blockChain[hash];
+        VHeaderHandle header(size_t height) const {
+            return entry(height).header;
         }
 
-        int insert(VBlock block) {
-            std::string blockHash = VHasher::getHash(block.toHex());
-            if (!hashMeetsTarget(blockHash, kCurrentDifficulty)) return 0;
-            if (block.prevBlock != this->chainHead) return 0;
-            blockChain[blockHash] = block;
-            this->chainHead = blockHash;
-            _size++;
-            return 1;
+        VHeaderHandle headerOf(const std::string& hash) const {
+            return header(heightOf(hash));
+        }
+
+        // Bodies may have to be loaded from disk. Throws BlockPrunedError below prunedHeight().
+        VBlockHandle at(size_t height) const {
+            const Entry& found = entry(height);
+            if (height < _pruned) throw BlockPrunedError(found.hash);
+            return bodies->get(found.hash);
+        }
+
+        VBlockHandle get(const std::string& hash) const {
+            return at(heightOf(hash));
+        }
+    };
+
+    typedef std::shared_ptr<const ChainSnapshot> ChainSnapshotHandle;
+
+    struct ChainBlock {
+        std::string hash;
+        VBlockHandle block;
+    };
+
+    struct ChainHeader {
+        std::string hash;
+        VHeaderHandle header;
+    };
+
+    enum class BlockStatus {
+        Invalid,      // fails proof of work
+        Duplicate,    // already known, possibly as an orphan
+        Orphan,       // parent unknown, held until it arrives
+        SideBranch,   // stored, but its branch does not have the most work
+        ExtendedTip,  // the active chain grew without disconnecting anything
+        Reorganized   // the active chain switched branches
+    };
+
+    // What an insert did to the active chain. disconnected is ordered from the old tip
+    // down, connected from the fork point up, which is the order to undo and apply them in.
+    struct ChainUpdate {
+        BlockStatus status = BlockStatus::Invalid;
+        std::vector<ChainBlock> disconnected;
+        std::vector<ChainBlock> connected;
+
+        bool tipChanged() const {
+            return status == BlockStatus::ExtendedTip || status == BlockStatus::Reorganized;
+        }
+    };
+
+    struct ChainStats {
+        size_t activeBlocks = 0;
+        size_t knownBlocks = 0;   // every connected block, on any branch
+        size_t staleBlocks = 0;   // known blocks that are not on the active chain
+        size_t orphans = 0;
+        uint64_t reorgs = 0;
+        size_t deepestReorg = 0;
+    };
+
+    // Hooks called by BlockChain on its writer path, in insert order. Observers must not
+    // call back into the chain's insert().
+    class ChainObserver
+    {
+    public:
+        virtual ~ChainObserver() {}
+
+        // A block was linked into the tree, on any branch.
+        virtual void blockAccepted(const std::string&, const VBlockHandle&) {}
+
+        // blockAccepted for the block is deferred, e.g. to a writer thread, and the block
+        // may be asked for before it arrives.
+        virtual void blockDeferred(const std::string&, const VBlockHandle&) {}
+
+        // The active chain now has update.connected at heights firstHeight and up, replacing
+        // update.disconnected.
+        virtual void activeChainChanged(size_t, const ChainUpdate&) {}
+
+        // The body of the block at the given tree height was pruned and will not be
+        // requested again. Called after the snapshot hiding it is published.
+        virtual void blockPruned(size_t, const std::string&) {}
+
+        // Flushes what the hooks wrote to stable storage.
+        virtual void sync() {}
+    };
+
+    // Expected number of hashes needed to meet a target of diffTarget leading hex zeroes.
+    double blockWork(uint8_t diffTarget) {
+        return std::pow(16.0, diffTarget);
+    }
+
+    // Thread-safe block tree. Every valid block is kept, including side branches, and
+    // blocks whose parent is unknown wait in a bounded orphan pool. Only headers stay
+    // resident; bodies live in a BlockCache, bounded when it is backed by a BlockSource. The active chain is the
+    // branch with the most cumulative work (ties keep the first-seen tip) and is published
+    // as an immutable ChainSnapshot: readers load it atomically and never block, while
+    // inserts are serialized through a single writer mutex.
+    //
+    // With a prune depth set, bodies of blocks more than that many blocks below the tip
+    // are dropped, on any branch, and observers are told so they can delete them too. A
+    // branch forking below the pruned height can no longer become active.
+    class BlockChain
+    {
+    private:
+        static const size_t kMaxOrphans = 1024;
+
+        struct BlockNode {
+            std::string prev;
+            size_t height;
+            double chainWork;
+            VHeaderHandle header;
+        };
+
+        ChainSnapshotHandle current; // only accessed through std::atomic_load/atomic_store
+        // Bumped after every snapshot with a new tip is published. std::atomic_load of a
+        // shared_ptr takes a lock in libstdc++, so hot loops poll this instead.
+        std::atomic<uint64_t> _tipGeneration{0};
+        std::mutex writer;
+
+        // Writer state, guarded by the writer mutex.
+        std::unordered_map<std::string, BlockNode> tree;
+        std::unordered_multimap<std::string, ChainBlock> orphansByParent;
+        std::deque<std::string> orphanOrder;
+        std::unordered_map<std::string, std::string> orphanParent;
+        std::string tip;
+        ChainStats _stats;
+        std::vector<ChainObserver*> observers;
+        std::shared_ptr<BlockCache> bodies;
+        size_t pruneDepth = 0;
+        uint8_t minDifficulty = kCurrentDifficulty;
+        std::multimap<size_t, std::string> unprunedBodies; // by height, blocks linked by insert
+
+        // A separate copy, so a resident header does not keep its body alive.
+        static VHeaderHandle headerOf(const VBlock& block) {
+            return std::make_shared<const VBlockHeader>(static_cast<const VBlockHeader&>(block));
+        }
+
+        static void appendTo(ChainSnapshot& next, const std::string& hash, const VHeaderHandle& header) {
+            const size_t height = next._size;
+            const size_t slot = height % ChainSnapshot::kSegmentSize;
+            if (slot == 0 && next.segments.size() * ChainSnapshot::kSegmentSize == height) {
+                next.segments.push_back(std::make_shared<ChainSnapshot::Segment>());
+            }
+            std::shared_ptr<ChainSnapshot::Segment>& segment = next.segments.back();
+            if (slot < segment->filled) {
+                segment = std::make_shared<ChainSnapshot::Segment>(*segment);
+            }
+            segment->entries[slot].hash = hash;
+            segment->entries[slot].header = header;
+            segment->filled = slot + 1;
+
+            auto& shard = next.index[ChainSnapshot::shardOf(hash)];
+            std::shared_ptr<ChainSnapshot::IndexShard> updated = shard
+                    ? std::make_shared<ChainSnapshot::IndexShard>(*shard)
+                    : std::make_shared<ChainSnapshot::IndexShard>();
+            (*updated)[hash] = height;
+            shard = updated;
+
+            next._size = height + 1;
+        }
+
+        // Drops the blocks at heights >= size from the snapshot's index and segments.
+        static void truncate(ChainSnapshot& next, size_t size) {
+            std::map<size_t, std::shared_ptr<ChainSnapshot::IndexShard>> touched;
+            for (size_t height = size; height < next._size; ++height) {
+                const std::string& hash = next.hashAt(height);
+                size_t shardIndex = ChainSnapshot::shardOf(hash);
+                auto it = touched.find(shardIndex);
+                if (it == touched.end()) {
+                    it = touched.emplace(shardIndex, std::make_shared<ChainSnapshot::IndexShard>(*next.index[shardIndex])).first;
+                }
+                it->second->erase(hash);
+            }
+            for (auto & shard : touched) {
+                next.index[shard.first] = shard.second;
+            }
+            next.segments.resize((size + ChainSnapshot::kSegmentSize - 1) / ChainSnapshot::kSegmentSize);
+            next._size = size;
+        }
+
+        void addOrphan(const std::string& hash, const VBlockHandle& block) {
+            if (orphanOrder.size() >= kMaxOrphans) {
+                const std::string& oldest = orphanOrder.front();
+                auto parent = orphanParent.find(oldest);
+                if (parent != orphanParent.end()) {
+                    auto range = orphansByParent.equal_range(parent->second);
+                    for (auto it = range.first; it != range.second; ++it) {
+                        if (it->second.hash == oldest) {
+                            orphansByParent.erase(it);
+                            break;
+                        }
+                    }
+                    orphanParent.erase(parent);
+                }
+                orphanOrder.pop_front();
+            }
+            orphansByParent.emplace(block->prevBlock, ChainBlock{hash, block});
+            orphanParent[hash] = block->prevBlock;
+            orphanOrder.push_back(hash);
+        }
+
+        // Links a block under its known parent, then any orphans waiting on it.
+        // Returns the connected node with the most work.
+        std::string connect(const std::string& hash, const VBlockHandle& block) {
+            std::string best = hash;
+            std::deque<ChainBlock> pending;
+            pending.push_back(ChainBlock{hash, block});
+            while (!pending.empty()) {
+                ChainBlock next = pending.front();
+                pending.pop_front();
+                const BlockNode& parent = tree.at(next.block->prevBlock);
+                BlockNode node{next.block->prevBlock, parent.height + 1, parent.chainWork + blockWork(next.block->diffTarget), headerOf(*next.block)};
+                tree.emplace(next.hash, node);
+                bodies->put(next.hash, next.block);
+                unprunedBodies.emplace(node.height, next.hash);
+                if (node.chainWork > tree.at(best).chainWork) best = next.hash;
+                for (auto observer : observers) {
+                    observer->blockAccepted(next.hash, next.block);
+                }
+
+                auto range = orphansByParent.equal_range(next.hash);
+                for (auto it = range.first; it != range.second; ++it) {
+                    pending.push_back(it->second);
+                    orphanParent.erase(it->second.hash);
+                    orphanOrder.erase(std::find(orphanOrder.begin(), orphanOrder.end(), it->second.hash));
+                }
+                orphansByParent.erase(range.first, range.second);
+            }
+            return best;
+        }
+
+        // Raises the snapshot's pruned height to pruneDepth below its tip and returns the
+        // previous one. Never lowers it, since pruned bodies cannot come back.
+        size_t advancePruned(ChainSnapshot& next) const {
+            const size_t previous = next._pruned;
+            if (pruneDepth > 0 && next._size > pruneDepth) next._pruned = std::max(previous, next._size - pruneDepth);
+            return previous;
+        }
+
+        // Drops the bodies hidden by a just-published snapshot: active blocks in
+        // [from, published._pruned) and every other block linked below that height.
+        void dropPruned(const ChainSnapshot& published, size_t from) {
+            for (size_t height = from; height < published._pruned; ++height) {
+                const std::string& hash = published.hashAt(height);
+                bodies->erase(hash);
+                for (auto observer : observers) {
+                    observer->blockPruned(height, hash);
+                }
+            }
+            auto end = unprunedBodies.lower_bound(published._pruned);
+            for (auto it = unprunedBodies.begin(); it != end; ++it) {
+                if (published.contains(it->second)) continue;
+                bodies->erase(it->second);
+                for (auto observer : observers) {
+                    observer->blockPruned(it->first, it->second);
+                }
+            }
+            unprunedBodies.erase(unprunedBodies.begin(), end);
+        }
+
+        void updateStats(const ChainSnapshot& snapshot) {
+            _stats.activeBlocks = snapshot.size();
+            _stats.knownBlocks = tree.size();
+            _stats.staleBlocks = tree.size() - snapshot.size();
+            _stats.orphans = orphanOrder.size();
+        }
+
+    public:
+        // A chain that keeps every body in memory.
+        BlockChain(VBlock genesis) : bodies(std::make_shared<BlockCache>()) {
+            std::string hash = genesis.hash();
+            if (!hashMeetsTarget(hash, genesis.diffTarget)) throw std::invalid_argument("Genesis block does not meet its difficulty target");
+
+            VBlockHandle block = std::make_shared<const VBlock>(std::move(genesis));
+            VHeaderHandle header = headerOf(*block);
+            tree.emplace(hash, BlockNode{block->prevBlock, 0, blockWork(block->diffTarget), header});
+            bodies->put(hash, block);
+            tip = hash;
+
+            std::shared_ptr<ChainSnapshot> snapshot = std::make_shared<ChainSnapshot>();
+            snapshot->bodies = bodies;
+            appendTo(*snapshot, hash, header);
+            updateStats(*snapshot);
+            current = snapshot;
+        }
+
+        // Restores a chain from the headers of its active blocks, genesis first, e.g. as
+        // loaded from a BlockStore. Bodies are read from source through an LRU cache of at
+        // most cacheBytes; source must outlive the chain and hold every block inserted
+        // later, typically by also being one of its observers. Bodies below prunedHeight
+        // were pruned before and are not requested. Proof of work is trusted; the
+        // prevBlock links are checked.
+        BlockChain(const std::vector<ChainHeader>& activeChain, const BlockSource* source, size_t prunedHeight = 0,
+                   size_t cacheBytes = kDefaultBlockCacheBytes)
+                : bodies(std::make_shared<BlockCache>(source, cacheBytes)) {
+            if (activeChain.empty()) throw std::invalid_argument("Cannot restore an empty chain");
+            if (prunedHeight > activeChain.size()) throw std::invalid_argument("Pruned height is above the chain");
+
+            std::shared_ptr<ChainSnapshot> snapshot = std::make_shared<ChainSnapshot>();
+            snapshot->bodies = bodies;
+            double chainWork = 0;
+            for (size_t height = 0; height < activeChain.size(); ++height) {
+                const ChainHeader& entry = activeChain[height];
+                if (height > 0 && entry.header->prevBlock != activeChain[height-1].hash) {
+                    throw std::runtime_error("Broken prevBlock link at height " + std::to_string(height));
+                }
+                chainWork += blockWork(entry.header->diffTarget);
+                tree.emplace(entry.hash, BlockNode{entry.header->prevBlock, height, chainWork, entry.header});
+                appendTo(*snapshot, entry.hash, entry.header);
+                if (height >= prunedHeight) unprunedBodies.emplace(height, entry.hash);
+            }
+            snapshot->_pruned = prunedHeight;
+            tip = activeChain.back().hash;
+            updateStats(*snapshot);
+            current = snapshot;
+        }
+
+        BlockChain(const BlockChain&) = delete;
+        BlockChain& operator=(const BlockChain&) = delete;
+
+        // Observers only see blocks inserted after they are added.
+        void addObserver(ChainObserver* observer) {
+            std::lock_guard<std::mutex> lock(writer);
+            observers.push_back(observer);
+        }
+
+        ChainSnapshotHandle snapshot() const {
+            return std::atomic_load(&current);
+        }
+
+        // Lowest difficulty target insert() accepts. Set it before blocks are inserted.
+        void setMinDifficulty(uint8_t difficulty) {
+            std::lock_guard<std::mutex> lock(writer);
+            minDifficulty = difficulty;
+        }
+
+        // Keeps bodies for only the newest depth active blocks (0 keeps all) and prunes
+        // older ones right away. Reorgs deeper than depth become impossible, so it should
+        // not be smaller than the deepest reorg the caller can undo.
+        void setPruneDepth(size_t depth) {
+            std::lock_guard<std::mutex> lock(writer);
+            pruneDepth = depth;
+            ChainSnapshotHandle base = std::atomic_load(&current);
+            std::shared_ptr<ChainSnapshot> next = std::make_shared<ChainSnapshot>(*base);
+            const size_t from = advancePruned(*next);
+            if (next->_pruned == from) return;
+            std::atomic_store(&current, ChainSnapshotHandle(next));
+            dropPruned(*next, from);
+        }
+
+        size_t prunedHeight() const {
+            return snapshot()->prunedHeight();
+        }
+
+        size_t size() const {
+            return snapshot()->size();
+        }
+
+        std::string head() const {
+            return snapshot()->head();
+        }
+
+        // Changes whenever the tip does; a lock-free way to notice a new head.
+        uint64_t tipGeneration() const {
+            return _tipGeneration.load(std::memory_order_acquire);
+        }
+
+        // Cheaper than comparing against head(), which copies the hash.
+        bool isHead(const std::string& hash) const {
+            return snapshot()->head() == hash;
+        }
+
+        bool contains(const std::string& hash) const {
+            return snapshot()->contains(hash);
+        }
+
+        size_t heightOf(const std::string& hash) const {
+            return snapshot()->heightOf(hash);
+        }
+
+        std::string hashAt(size_t height) const {
+            return snapshot()->hashAt(height);
+        }
+
+        VHeaderHandle header(size_t height) const {
+            return snapshot()->header(height);
+        }
+
+        VBlockHandle at(size_t height) const {
+            return snapshot()->at(height);
+        }
+
+        VBlockHandle get(const std::string& hash) const {
+            return snapshot()->get(hash);
+        }
+
+        BlockCacheStats cacheStats() const {
+            return bodies->stats();
+        }
+
+        ChainStats stats() {
+            std::lock_guard<std::mutex> lock(writer);
+            return _stats;
+        }
+
+        ChainUpdate insert(VBlock block) {
+            ChainUpdate update;
+            std::string blockHash = block.hash();
+            if (block.diffTarget < minDifficulty || !hashMeetsTarget(blockHash, block.diffTarget)) return update;
+
+            std::lock_guard<std::mutex> lock(writer);
+            if (tree.count(blockHash) || orphanParent.count(blockHash)) {
+                update.status = BlockStatus::Duplicate;
+                return update;
+            }
+
+            VBlockHandle handle = std::make_shared<const VBlock>(std::move(block));
+            if (!tree.count(handle->prevBlock)) {
+                addOrphan(blockHash, handle);
+                _stats.orphans = orphanOrder.size();
+                update.status = BlockStatus::Orphan;
+                return update;
+            }
+
+            std::string best = connect(blockHash, handle);
+            ChainSnapshotHandle base = std::atomic_load(&current);
+            if (tree.at(best).chainWork <= tree.at(tip).chainWork) {
+                updateStats(*base);
+                update.status = BlockStatus::SideBranch;
+                return update;
+            }
+
+            // Walk back from the new tip to the first block on the active chain.
+            std::vector<std::string> path;
+            std::string cursor = best;
+            while (true) {
+                const BlockNode& node = tree.at(cursor);
+                if (node.height < base->size() && base->hashAt(node.height) == cursor) break;
+                path.push_back(cursor);
+                cursor = node.prev;
+            }
+            const size_t forkHeight = tree.at(cursor).height;
+            if (forkHeight + 1 < base->_pruned) {
+                updateStats(*base);
+                update.status = BlockStatus::SideBranch;
+                return update;
+            }
+
+            for (size_t height = base->size() - 1; height > forkHeight; --height) {
+                update.disconnected.push_back(ChainBlock{base->hashAt(height), base->at(height)});
+            }
+
+            std::shared_ptr<ChainSnapshot> next = std::make_shared<ChainSnapshot>(*base);
+            truncate(*next, forkHeight + 1);
+            for (auto it = path.rbegin(); it != path.rend(); ++it) {
+                appendTo(*next, *it, tree.at(*it).header);
+                update.connected.push_back(ChainBlock{*it, bodies->get(*it)});
+            }
+
+            if (update.disconnected.empty()) update.status = BlockStatus::ExtendedTip;
+            else {
+                update.status = BlockStatus::Reorganized;
+                _stats.reorgs++;
+                _stats.deepestReorg = std::max(_stats.deepestReorg, update.disconnected.size());
+            }
+            tip = best;
+            updateStats(*next);
+            const size_t prunedFrom = advancePruned(*next);
+            std::atomic_store(&current, ChainSnapshotHandle(next));
+            _tipGeneration.fetch_add(1, std::memory_order_release);
+            for (auto observer : observers) {
+                observer->activeChainChanged(forkHeight + 1, update);
+            }
+            dropPruned(*next, prunedFrom);
+            return update;
+        }
+    };
+
+    // Balances the accounts touched by a block had before it, enough to revert it exactly.
+    struct BlockUndo {
+        std::vector<std::pair<std::string, double>> previous;
+        std::vector<std::string> created;
+    };
+
+    BlockUndo applyBlock(VUsers& users, const VTransactions& transactions) {
+        BlockUndo undo;
+        std::unordered_map<std::string, bool> seen;
+        for (const auto & transaction : transactions) {
+            for (const std::string* key : { &transaction.sender(), &transaction.receiver() }) {
+                if (!seen.emplace(*key, true).second) continue;
+                auto user = users.find(*key);
+                if (user == users.end()) undo.created.push_back(*key);
+                else undo.previous.emplace_back(*key, user->second.balance);
+            }
+        }
+        updateUsersBalance(users, transactions);
+        return undo;
+    }
+
+    void undoBlock(VUsers& users, const BlockUndo& undo) {
+        for (const auto & previous : undo.previous) {
+            users[previous.first].balance = previous.second;
+        }
+        for (const auto & key : undo.created) {
+            users.erase(key);
+        }
+    }
+
+    // Keeps undo data for the most recent active blocks so the balances can follow reorgs
+    // of up to maxDepth blocks without replaying the chain.
+    class UndoLog
+    {
+    private:
+        std::deque<std::pair<std::string, BlockUndo>> entries;
+        size_t maxDepth;
+
+    public:
+        explicit UndoLog(size_t maxDepth = 100) : maxDepth(maxDepth) {}
+
+        void apply(VUsers& users, const ChainUpdate& update) {
+            for (const auto & block : update.disconnected) {
+                if (entries.empty() || entries.back().first != block.hash) {
+                    throw std::runtime_error("Reorg deeper than the undo log: " + block.hash);
+                }
+                undoBlock(users, entries.back().second);
+                entries.pop_back();
+            }
+            for (const auto & block : update.connected) {
+                entries.emplace_back(block.hash, applyBlock(users, block.block->transactions));
+                if (entries.size() > maxDepth) entries.pop_front();
+            }
+        }
+    };
+
+    // What one Miner::mine call did.
+    struct MiningResult {
+        bool found = false;         // the block meets its target; false if mining was abandoned
+        uint64_t attempts = 0;      // header hashes computed
+        double merkleSeconds = 0;
+        double seconds = 0;         // the whole call
+
+        double hashrate() const {
+            return seconds > 0 ? attempts / seconds : 0;
         }
     };
 
     class Miner
     {
     public:
-        static void mine(VBlock& block, BlockChain* chain = nullptr, uint64_t seed = 0) {
+        // Mines block at its diffTarget on top of its prevBlock, or of the chain's head (the
+        // null parent without a chain) if it has none. With a chain, mining stops early once
+        // prevBlock is no longer the head, as the block would only go stale.
+        static MiningResult mine(VBlock& block, BlockChain* chain = nullptr, uint64_t seed = 0) {
+            typedef std::chrono::steady_clock Clock;
+            MiningResult result;
+            const Clock::time_point start = Clock::now();
             block.nonce = seed;
 
             bc::hash_list tx_hashes;
+            tx_hashes.reserve(block.transactions.size());
             for (auto it = block.transactions.begin(); it != block.transactions.end(); ++it) {
-                std::array<unsigned char, 32> hash;
-                std::string tx_hash = VHasher::getHash(it->toHex());
-                for (int i = 0; i < 32; ++i) {
-                    hash[i] = tx_hash[i];
-                }
-                tx_hashes.push_back(hash);
+                tx_hashes.push_back(it->hash());
             }
             block.merkleRootHash = bc::encode_base16(create_merkle(tx_hashes));
+            result.merkleSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+            if (block.prevBlock.empty()) block.prevBlock = chain != nullptr ? chain->head() : VHasher::getHash("");
 
-            if (chain != nullptr) block.prevBlock = chain->head();
-            else block.prevBlock = VHasher::getHash("");
-            block.diffTarget = kCurrentDifficulty;
+            // Only the timestamp and nonce change between attempts, so the header prefix is
+            // serialized once and the tail is rewritten in place.
+            std::string header;
+            header.reserve(block.serializedHeaderSize());
+            block.serializePrefix(header);
+            const size_t prefixSize = header.size();
+            // The head is compared once; after that, polling the tip generation tells
+            // whether it moved without touching the snapshot pointer.
+            const uint64_t generation = chain != nullptr ? chain->tipGeneration() : 0;
+            const bool onHead = chain == nullptr || chain->isHead(block.prevBlock);
             do
             {
                 block.timeStamp = std::time(nullptr);
                 block.nonce++;
+                header.resize(prefixSize);
+                block.serializeSuffix(header);
+                result.attempts++;
+                result.found = hashMeetsTarget(VHasher::getHash(header), block.diffTarget);
             }
-            while (!hashMeetsTarget(VHasher::getHash(block.toHex()), kCurrentDifficulty) && (chain == nullptr || block.prevBlock == chain->head()));
+            while (!result.found && onHead && (chain == nullptr || chain->tipGeneration() == generation));
+            result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            return result;
         }
     };
 
@@ -265,39 +1370,243 @@ namespace VCoin
 
 namespace VCoin { namespace IO
     {
-        VUsers getUsersFromFile(const std::string& fpath) {
-            VUsers users;
+        // Parsing of the text data files: whitespace-separated fields, one record per line,
+        // read up to the first empty line. Fields are extracted the way operator>> does
+        // ("C" locale), so the results match a std::getline + std::stringstream reader,
+        // missing or malformed fields included, without allocating per line.
+        namespace Text
+        {
+            // operator>>'s notion of whitespace in the "C" locale.
+            bool isSpace(char c) {
+                return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+            }
+
+            bool isDigit(char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            // The fields of one line. Like a stream, numbers stop at the first character that
+            // cannot continue them, and once an extraction fails the rest yield empty values.
+            class Fields
+            {
+            private:
+                const char* at;
+                const char* end;
+                bool failed = false;
 
-            std::ifstream in(fpath);
-            if (!in.is_open()) throw std::runtime_error("Failed to open file " + fpath);
+                bool skipSpace() {
+                    while (at < end && isSpace(*at)) ++at;
+                    if (at == end) failed = true;
+                    return !failed;
+                }
 
-            std::string line;
-            while (std::getline(in, line)) {
-                if (line.empty()) break;
-                std::stringstream sstream(line);
-                VUser user;
-                sstream >> user.key >> user.name >> user.balance;
-                users[user.key] = user;
-            } in.close();
+            public:
+                Fields(const char* begin, const char* end) : at(begin), end(end) {}
 
-            return users;
+                std::string string() {
+                    if (failed || !skipSpace()) return std::string();
+                    const char* begin = at;
+                    while (at < end && !isSpace(*at)) ++at;
+                    return std::string(begin, at);
+                }
+
+                // [sign] digits [. digits] [e [sign] digits], converted with strtod as
+                // libstdc++ does; out of range values saturate.
+                double number() {
+                    if (failed || !skipSpace()) return 0;
+                    char buffer[128];
+                    std::string spill;
+                    size_t length = 0;
+                    auto take = [&]() {
+                        if (length + 1 < sizeof(buffer)) buffer[length] = *at;
+                        else {
+                            // Absurdly long numbers fall back to a heap copy.
+                            if (spill.empty()) spill.assign(buffer, length);
+                            spill += *at;
+                        }
+                        ++length;
+                        ++at;
+                    };
+                    bool mantissa = false;
+                    if (at < end && (*at == '+' || *at == '-')) take();
+                    while (at < end && isDigit(*at)) { take(); mantissa = true; }
+                    if (at < end && *at == '.') {
+                        take();
+                        while (at < end && isDigit(*at)) { take(); mantissa = true; }
+                    }
+                    if (mantissa && at < end && (*at == 'e' || *at == 'E')) {
+                        take();
+                        if (at < end && (*at == '+' || *at == '-')) take();
+                        while (at < end && isDigit(*at)) take();
+                    }
+
+                    const char* text = buffer;
+                    if (length + 1 > sizeof(buffer)) text = spill.c_str();
+                    else buffer[length] = '\0';
+                    char* parsed = nullptr;
+                    errno = 0;
+                    double value = std::strtod(text, &parsed);
+                    if (length == 0 || parsed != text + length) {
+                        failed = true;
+                        return 0;
+                    }
+                    if (errno == ERANGE && std::fabs(value) == HUGE_VAL) {
+                        failed = true;
+                        return value > 0 ? std::numeric_limits<double>::max() : -std::numeric_limits<double>::max();
+                    }
+                    return value;
+                }
+
+                // [sign] digits; out of range values saturate.
+                long long integer() {
+                    if (failed || !skipSpace()) return 0;
+                    bool negative = false;
+                    if (at < end && (*at == '+' || *at == '-')) negative = *at++ == '-';
+                    const unsigned long long limit = negative ? static_cast<unsigned long long>(LLONG_MAX) + 1 : LLONG_MAX;
+                    unsigned long long magnitude = 0;
+                    bool digits = false, overflow = false;
+                    for (; at < end && isDigit(*at); ++at) {
+                        digits = true;
+                        unsigned digit = static_cast<unsigned>(*at - '0');
+                        if (overflow || magnitude > (limit - digit) / 10) overflow = true;
+                        else magnitude = magnitude * 10 + digit;
+                    }
+                    if (!digits || overflow) {
+                        failed = true;
+                        if (!digits) return 0;
+                        return negative ? LLONG_MIN : LLONG_MAX;
+                    }
+                    return negative ? static_cast<long long>(0 - magnitude) : static_cast<long long>(magnitude);
+                }
+            };
+
+            // Line boundaries of a mapped file, found in parallel chunks. Lines end at '\n'
+            // (a trailing '\r' stays part of the line, as with std::getline) and the file
+            // ends at its first empty line.
+            class Lines
+            {
+            private:
+                struct Chunk {
+                    const char* begin;
+                    const char* end;
+                    size_t lines = 0;
+                    size_t first = 0;    // index of its first line in the file
+                    bool stopped = false; // contains the first empty line
+                };
+
+                std::vector<Chunk> chunks;
+                size_t _size = 0;
+
+            public:
+                Lines(const char* data, size_t size) {
+                    const size_t kChunkBytes = 1 << 20;
+                    size_t count = std::max<size_t>(1, std::min<size_t>(size / kChunkBytes + 1, 64 * omp_get_max_threads()));
+                    const char* end = data + size;
+                    const char* start = data;
+                    for (size_t c = 1; c <= count && start < end; ++c) {
+                        const char* boundary = c == count ? end : data + size / count * c;
+                        if (boundary < start) boundary = start;
+                        const char* newline = boundary < end ? static_cast<const char*>(std::memchr(boundary, '\n', end - boundary)) : nullptr;
+                        const char* finish = c == count || newline == nullptr ? end : newline + 1;
+                        Chunk chunk;
+                        chunk.begin = start;
+                        chunk.end = finish;
+                        chunks.push_back(chunk);
+                        start = finish;
+                    }
+
+                    const long total = static_cast<long>(chunks.size());
+#pragma omp parallel for schedule(dynamic, 1)
+                    for (long c = 0; c < total; ++c) {
+                        Chunk& chunk = chunks[c];
+                        for (const char* at = chunk.begin; at < chunk.end; ) {
+                            const char* newline = static_cast<const char*>(std::memchr(at, '\n', chunk.end - at));
+                            if (newline == at) {
+                                chunk.stopped = true;
+                                break;
+                            }
+                            chunk.lines++;
+                            if (newline == nullptr) break;
+                            at = newline + 1;
+                        }
+                    }
+
+                    for (size_t c = 0; c < chunks.size(); ++c) {
+                        chunks[c].first = _size;
+                        _size += chunks[c].lines;
+                        if (chunks[c].stopped) {
+                            chunks.resize(c + 1);
+                            break;
+                        }
+                    }
+                }
+
+                size_t size() const {
+                    return _size;
+                }
+
+                // Calls parse(index, begin, end) for every line, in parallel.
+                template <typename Parse>
+                void forEach(Parse parse) const {
+                    const long total = static_cast<long>(chunks.size());
+#pragma omp parallel for schedule(dynamic, 1)
+                    for (long c = 0; c < total; ++c) {
+                        const Chunk& chunk = chunks[c];
+                        const char* at = chunk.begin;
+                        for (size_t line = 0; line < chunk.lines; ++line) {
+                            const char* newline = static_cast<const char*>(std::memchr(at, '\n', chunk.end - at));
+                            const char* finish = newline != nullptr ? newline : chunk.end;
+                            parse(chunk.first + line, at, finish);
+                            at = finish + 1;
+                        }
+                    }
+                }
+            };
         }
 
-        VTransactions getTransactionsFromFile(const std::string& fpath) {
-            VTransactions transactions;
+        VUsers getUsersFromFile(const std::string& fpath) {
+            MappedFile file(fpath);
+            Text::Lines lines(file.data(), file.size());
+            std::vector<VUser> parsed(lines.size());
+            lines.forEach([&parsed](size_t index, const char* begin, const char* end) {
+                Text::Fields fields(begin, end);
+                VUser& user = parsed[index];
+                user.key = fields.string();
+                user.name = fields.string();
+                user.balance = fields.number();
+            });
 
-            std::ifstream in(fpath);
-            if (!in.is_open()) throw std::runtime_error("Failed to open file " + fpath);
+            // Later lines win, as they overwrite earlier ones with the same key.
+            VUsers users;
+            for (auto & user : parsed) {
+                users[user.key] = std::move(user);
+            }
+            return users;
+        }
 
-            std::string line;
-            while (std::getline(in, line)) {
-                if (line.empty()) break;
-                std::stringstream sstream(line);
-                VTransaction transaction;
-                sstream >> transaction.id >> transaction.receiver >> transaction.sender >> transaction.sum >> transaction.timestamp;
-                transactions.push_back(transaction);
-            } in.close();
+        // One line of a transactions text file: id, receiver, sender, sum, timestamp.
+        // Constructing the transaction hashes its body. Text files may predate the binary
+        // encoding, so legacy ids are upgraded.
+        VTransaction parseTransactionLine(const char* begin, const char* end) {
+            Text::Fields fields(begin, end);
+            std::string id = fields.string();
+            std::string receiver = fields.string();
+            std::string sender = fields.string();
+            double sum = fields.number();
+            time_t timestamp = static_cast<time_t>(fields.integer());
+            VTransaction transaction(std::move(sender), std::move(receiver), sum, timestamp, std::move(id));
+            transaction.upgradeLegacyId();
+            return transaction;
+        }
 
+        // The parallel parse also spreads the hashing across threads.
+        VTransactions getTransactionsFromFile(const std::string& fpath) {
+            MappedFile file(fpath);
+            Text::Lines lines(file.data(), file.size());
+            VTransactions transactions(lines.size());
+            lines.forEach([&transactions](size_t index, const char* begin, const char* end) {
+                transactions[index] = parseTransactionLine(begin, end);
+            });
             return transactions;
         }
 
@@ -305,66 +1614,27 @@ namespace VCoin { namespace IO
             std::ofstream out;
             if (append) out.open(fpath, std::ofstream::app);
             else out.open(fpath);
+            out << std::setprecision(std::numeric_limits<double>::max_digits10);
 
             for (auto & user : users) {
                 out << user.second.key << " " << user.second.name << " " << user.second.balance << "\n";
             } out.close();
         }
 
+        // Writes one transactions.dat line; the stream must use max_digits10 precision.
+        void writeTransaction(std::ostream& out, const VTransaction& transaction) {
+            out << transaction.id << " " << transaction.receiver() << " " << transaction.sender() << " " << transaction.sum() << " " << transaction.timestamp() << "\n";
+        }
+
         void writeTransactionsToFile(const std::string& fpath, const VTransactions& transactions, bool append = false) {
             std::ofstream out;
             if (append) out.open(fpath, std::ofstream::app);
             else out.open(fpath);
+            out << std::setprecision(std::numeric_limits<double>::max_digits10);
 
             for (auto & transaction : transactions) {
-                out << transaction.id << " " << transaction.receiver << " " << transaction.sender << " " << transaction.sum << " " << transaction.timestamp << "\n";
+                writeTransaction(out, transaction);
             } out.close();
         }
-
-        void genRandUsers(VUsers& users, uint32_t count, double minBalance, double maxBalance) {
-            users.clear();
-            std::default_random_engine generator;
-
-            const std::vector<std::string> randNames = {
-                    "Tomas", "Matas", "Danielius", "Augustinas", "Viktoras", "Ernestas", "Adomas", "Darius", "Zydrunas", "Ignas",
-                    "Elena", "Lilija", "Smilte", "Viktorija", "Urte", "Regina", "Kristina", "Leja", "Austeja", "Jolanta"
-            };
-
-            for (int i = 0; i < count; ++i) {
-                VUser user;
-
-                std::uniform_int_distribution<int> keyDist;
-                user.key = VHasher::getHash(std::to_string(keyDist(generator)));
-                std::uniform_real_distribution<double> balDist(minBalance, maxBalance);
-                user.balance = balDist(generator);
-                std::uniform_int_distribution<int> nameDist(0, randNames.size()-1);
-                user.name = randNames[nameDist(generator)];
-
-                users[user.key] = user;
-            }
-        }
-
-        void genRandTransactions(VTransactions& transactions, const VUsers& users, uint32_t count, double minSum, double maxSum, uint32_t maxTransAge) {
-            transactions.clear();
-            std::default_random_engine generator;
-
-            for (int i = 0; i < count; ++i) {
-                VTransaction transaction;
-
-                std::uniform_int_distribution<int> userDist(0, users.size()-1);
-                auto randSender = users.begin();
-                std::advance(randSender, userDist(generator));
-                transaction.sender = randSender->second.key;
-                auto randReceiver = users.begin();
-                std::advance(randReceiver, userDist(generator));
-                transaction.receiver = randReceiver->second.key;
-                std::uniform_real_distribution<double> sumDist(minSum, maxSum);
-                transaction.sum = sumDist(generator);
-                std::uniform_int_distribution<int> timeDist(0, maxTransAge);
-                transaction.timestamp = std::time(nullptr) - timeDist(generator);
-                transaction.id = VHasher::getHash(transaction.toHex());
-                transactions.push_back(transaction);
-            }
-        }
     } }
 
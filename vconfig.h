@@ -0,0 +1,383 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+#include <initializer_list>
+#include <thread>
+#include <limits>
+#include <sstream>
+#include <cerrno>
+#include <cstdlib>
+#include "vcoin.h"
+#include "vmempool.h"
+#include "vpersist.h"
+#include "vgenerate.h"
+
+namespace VCoin
+{
+    // Everything a simulation run can be set up with, so experiments need no rebuild. A
+    // chain must be continued with the difficulty it was started with: blocks below the
+    // configured one are rejected and reported by verify.
+    struct SimulationConfig {
+        // Mining
+        size_t miners = std::max(std::thread::hardware_concurrency(), 1u);
+        uint32_t transactionsPerBlock = kTransactionsPerBlock;
+        uint8_t difficulty = kCurrentDifficulty;
+
+        // The data set a new simulation starts from, reproducible from the seed.
+        uint64_t seed = 1;
+        size_t users = 1000;
+        double minBalance = 100, maxBalance = 1000000;
+        size_t transactions = 1000;
+        WorkloadModel workload;              // uniform unless skewed models are asked for
+        std::string trace;                   // arrival trace to replay, see IO::getArrivalTrace
+
+        // Transaction pool and ingestion; a zero ingest target is half the pool's budget,
+        // leaving headroom for transactions returned by reorgs.
+        size_t mempoolBytes = kDefaultMempoolBytes;
+        time_t mempoolMaxAge = 24*3600;
+        std::string ingest;                  // transactions file to stream instead of generating
+        size_t ingestBatch = 4096;
+        size_t ingestTargetBytes = 0;
+
+        // Storage. Snapshots are taken every snapshotInterval blocks, so a restart replays at
+        // most that many; a non-zero prune depth has to cover it and the deepest reorg.
+        std::string dataDir = ".";
+        size_t snapshotInterval = 10;
+        size_t pruneDepth = 0;
+        size_t maxQueuedWrites = 8;
+        SyncPolicy syncPolicy = SyncPolicy::Always;
+        std::string metrics = "metrics.jsonl"; // per-block metrics file, .csv for CSV; empty for none
+
+        // Throws std::invalid_argument if the settings cannot work together.
+        void validate() const {
+            if (miners == 0) throw std::invalid_argument("At least one miner is needed");
+            if (transactionsPerBlock == 0) throw std::invalid_argument("Blocks need room for a transaction");
+            if (difficulty > 64) throw std::invalid_argument("A block hash has only 64 hex digits");
+            if (snapshotInterval == 0) throw std::invalid_argument("The snapshot interval must be positive");
+            if (minBalance > maxBalance || workload.minSum > workload.maxSum) throw std::invalid_argument("A minimum exceeds its maximum");
+            if (workload.arrivals == ArrivalModel::Trace && trace.empty()) throw std::invalid_argument("Trace arrivals need a trace file");
+        }
+
+        // A file in the data directory; absolute paths are kept.
+        std::string path(const std::string& name) const {
+            if (!name.empty() && name[0] == '/') return name;
+            return dataDir + "/" + name;
+        }
+
+        size_t ingestTarget() const {
+            return ingestTargetBytes > 0 ? ingestTargetBytes : mempoolBytes / 2;
+        }
+    };
+
+    namespace Config
+    {
+        template <typename T>
+        typename std::enable_if<std::is_integral<T>::value>::type parseValue(const std::string& text, T& value) {
+            char* end = nullptr;
+            errno = 0;
+            bool inRange;
+            T parsed;
+            if (std::is_signed<T>::value) {
+                long long number = std::strtoll(text.c_str(), &end, 10);
+                inRange = number >= static_cast<long long>(std::numeric_limits<T>::min()) && number <= static_cast<long long>(std::numeric_limits<T>::max());
+                parsed = static_cast<T>(number);
+            }
+            else {
+                unsigned long long number = std::strtoull(text.c_str(), &end, 10);
+                inRange = text.find('-') == std::string::npos && number <= static_cast<unsigned long long>(std::numeric_limits<T>::max());
+                parsed = static_cast<T>(number);
+            }
+            if (text.empty() || *end != '\0' || errno == ERANGE || !inRange) throw std::invalid_argument("not a valid integer: " + text);
+            value = parsed;
+        }
+
+        void parseValue(const std::string& text, double& value) {
+            char* end = nullptr;
+            errno = 0;
+            double parsed = std::strtod(text.c_str(), &end);
+            if (text.empty() || *end != '\0' || errno == ERANGE) throw std::invalid_argument("not a valid number: " + text);
+            value = parsed;
+        }
+
+        void parseValue(const std::string& text, std::string& value) {
+            value = text;
+        }
+
+        template <typename T>
+        typename std::enable_if<std::is_integral<T>::value, std::string>::type formatValue(const T& value) {
+            return std::to_string(+value);
+        }
+
+        std::string formatValue(double value) {
+            std::ostringstream out;
+            out << value;
+            return out.str();
+        }
+
+        std::string formatValue(const std::string& value) {
+            return value;
+        }
+
+        // Enumerations are set by name.
+        template <typename E>
+        void parseChoice(const std::string& text, E& value, std::initializer_list<std::pair<const char*, E>> choices) {
+            std::string names;
+            for (const auto & choice : choices) {
+                if (text == choice.first) {
+                    value = choice.second;
+                    return;
+                }
+                names += names.empty() ? choice.first : std::string("|") + choice.first;
+            }
+            throw std::invalid_argument("expected " + names + ", not " + text);
+        }
+
+        template <typename E>
+        std::string formatChoice(E value, std::initializer_list<std::pair<const char*, E>> choices) {
+            for (const auto & choice : choices) {
+                if (value == choice.second) return choice.first;
+            }
+            return "?";
+        }
+
+        void parseValue(const std::string& text, Popularity& value) {
+            parseChoice<Popularity>(text, value, { { "uniform", Popularity::Uniform }, { "zipf", Popularity::Zipf } });
+        }
+
+        std::string formatValue(Popularity value) {
+            return formatChoice<Popularity>(value, { { "uniform", Popularity::Uniform }, { "zipf", Popularity::Zipf } });
+        }
+
+        void parseValue(const std::string& text, AmountModel& value) {
+            parseChoice<AmountModel>(text, value, { { "uniform", AmountModel::Uniform }, { "pareto", AmountModel::Pareto } });
+        }
+
+        std::string formatValue(AmountModel value) {
+            return formatChoice<AmountModel>(value, { { "uniform", AmountModel::Uniform }, { "pareto", AmountModel::Pareto } });
+        }
+
+        void parseValue(const std::string& text, ArrivalModel& value) {
+            parseChoice<ArrivalModel>(text, value, { { "uniform", ArrivalModel::Uniform }, { "bursty", ArrivalModel::Bursty }, { "trace", ArrivalModel::Trace } });
+        }
+
+        std::string formatValue(ArrivalModel value) {
+            return formatChoice<ArrivalModel>(value, { { "uniform", ArrivalModel::Uniform }, { "bursty", ArrivalModel::Bursty }, { "trace", ArrivalModel::Trace } });
+        }
+
+        void parseValue(const std::string& text, SyncPolicy& value) {
+            parseChoice<SyncPolicy>(text, value, { { "always", SyncPolicy::Always }, { "periodic", SyncPolicy::Periodic }, { "never", SyncPolicy::Never } });
+        }
+
+        std::string formatValue(SyncPolicy value) {
+            return formatChoice<SyncPolicy>(value, { { "always", SyncPolicy::Always }, { "periodic", SyncPolicy::Periodic }, { "never", SyncPolicy::Never } });
+        }
+
+        // The named settings of a SimulationConfig, set from "name=value" text as given on
+        // the command line or in a config file.
+        class Options
+        {
+        private:
+            struct Option {
+                std::string help;
+                std::function<void(SimulationConfig&, const std::string&)> set;
+                std::function<std::string(const SimulationConfig&)> get;
+            };
+
+            std::map<std::string, Option> options;
+            std::vector<std::string> order;
+
+            // field returns the setting's member of a config.
+            template <typename T>
+            void add(const std::string& name, const std::string& help, std::function<T&(SimulationConfig&)> field) {
+                Option option;
+                option.help = help;
+                option.set = [field](SimulationConfig& config, const std::string& text) { parseValue(text, field(config)); };
+                option.get = [field](const SimulationConfig& config) {
+                    SimulationConfig copy = config;
+                    return formatValue(field(copy));
+                };
+                options[name] = option;
+                order.push_back(name);
+            }
+
+        public:
+            Options() {
+                add<size_t>("miners", "mining threads", [](SimulationConfig& c) -> size_t& { return c.miners; });
+                add<uint32_t>("block-transactions", "most transactions per block", [](SimulationConfig& c) -> uint32_t& { return c.transactionsPerBlock; });
+                add<uint8_t>("difficulty", "leading zero hex digits a block hash needs", [](SimulationConfig& c) -> uint8_t& { return c.difficulty; });
+                add<uint64_t>("seed", "seed of the generated data set", [](SimulationConfig& c) -> uint64_t& { return c.seed; });
+                add<size_t>("users", "generated users", [](SimulationConfig& c) -> size_t& { return c.users; });
+                add<double>("min-balance", "smallest generated balance", [](SimulationConfig& c) -> double& { return c.minBalance; });
+                add<double>("max-balance", "largest generated balance", [](SimulationConfig& c) -> double& { return c.maxBalance; });
+                add<size_t>("transactions", "generated transactions", [](SimulationConfig& c) -> size_t& { return c.transactions; });
+                add<Popularity>("senders", "sender popularity: uniform|zipf", [](SimulationConfig& c) -> Popularity& { return c.workload.senders; });
+                add<double>("sender-exponent", "Zipf exponent of senders", [](SimulationConfig& c) -> double& { return c.workload.senderExponent; });
+                add<Popularity>("receivers", "receiver popularity: uniform|zipf", [](SimulationConfig& c) -> Popularity& { return c.workload.receivers; });
+                add<double>("receiver-exponent", "Zipf exponent of receivers", [](SimulationConfig& c) -> double& { return c.workload.receiverExponent; });
+                add<AmountModel>("amounts", "transaction sums: uniform|pareto", [](SimulationConfig& c) -> AmountModel& { return c.workload.amounts; });
+                add<double>("min-sum", "smallest transaction sum", [](SimulationConfig& c) -> double& { return c.workload.minSum; });
+                add<double>("max-sum", "largest transaction sum", [](SimulationConfig& c) -> double& { return c.workload.maxSum; });
+                add<double>("tail-index", "Pareto tail index of sums", [](SimulationConfig& c) -> double& { return c.workload.tailIndex; });
+                add<ArrivalModel>("arrivals", "arrival times: uniform|bursty|trace", [](SimulationConfig& c) -> ArrivalModel& { return c.workload.arrivals; });
+                add<uint32_t>("max-age", "seconds back generated arrivals reach", [](SimulationConfig& c) -> uint32_t& { return c.workload.maxAge; });
+                add<size_t>("bursts", "arrival bursts", [](SimulationConfig& c) -> size_t& { return c.workload.bursts; });
+                add<double>("burst-share", "fraction of arrivals in bursts", [](SimulationConfig& c) -> double& { return c.workload.burstShare; });
+                add<double>("burst-seconds", "mean delay of an arrival after its burst starts", [](SimulationConfig& c) -> double& { return c.workload.burstSeconds; });
+                add<std::string>("trace", "arrival trace file, implies arrivals=trace", [](SimulationConfig& c) -> std::string& { return c.trace; });
+                add<size_t>("mempool-bytes", "transaction pool budget", [](SimulationConfig& c) -> size_t& { return c.mempoolBytes; });
+                add<time_t>("mempool-max-age", "seconds before a pooled transaction expires, 0 for never", [](SimulationConfig& c) -> time_t& { return c.mempoolMaxAge; });
+                add<std::string>("ingest", "text or binary transactions file to mine instead of generated ones", [](SimulationConfig& c) -> std::string& { return c.ingest; });
+                add<size_t>("ingest-batch", "transactions read per ingestion batch", [](SimulationConfig& c) -> size_t& { return c.ingestBatch; });
+                add<size_t>("ingest-target-bytes", "pool size ingestion keeps up, 0 for half the budget", [](SimulationConfig& c) -> size_t& { return c.ingestTargetBytes; });
+                add<std::string>("data-dir", "directory of the chain and state files", [](SimulationConfig& c) -> std::string& { return c.dataDir; });
+                add<size_t>("snapshot-interval", "blocks between ledger snapshots", [](SimulationConfig& c) -> size_t& { return c.snapshotInterval; });
+                add<size_t>("prune-depth", "blocks below the tip whose bodies are kept, 0 for all", [](SimulationConfig& c) -> size_t& { return c.pruneDepth; });
+                add<size_t>("max-queued-writes", "journal records and tasks queued before mining stalls", [](SimulationConfig& c) -> size_t& { return c.maxQueuedWrites; });
+                add<std::string>("metrics", "per-block metrics file in data-dir, JSON lines or .csv; empty for none", [](SimulationConfig& c) -> std::string& { return c.metrics; });
+                add<SyncPolicy>("sync", "journal syncs: always|periodic|never", [](SimulationConfig& c) -> SyncPolicy& { return c.syncPolicy; });
+            }
+
+            bool has(const std::string& name) const {
+                return options.count(name) != 0;
+            }
+
+            // Throws std::invalid_argument for an unknown name or a malformed value.
+            void set(SimulationConfig& config, const std::string& name, const std::string& value) const {
+                auto option = options.find(name);
+                if (option == options.end()) throw std::invalid_argument("Unknown setting " + name);
+                try {
+                    option->second.set(config, value);
+                }
+                catch (const std::invalid_argument& e) {
+                    throw std::invalid_argument("Bad value for " + name + ": " + e.what());
+                }
+                if (name == "trace" && !value.empty()) config.workload.arrivals = ArrivalModel::Trace;
+            }
+
+            std::string get(const SimulationConfig& config, const std::string& name) const {
+                auto option = options.find(name);
+                if (option == options.end()) throw std::invalid_argument("Unknown setting " + name);
+                return option->second.get(config);
+            }
+
+            // Applies a file of "name = value" lines; blank lines and '#' comments are skipped.
+            void load(SimulationConfig& config, const std::string& fpath) const {
+                std::ifstream in(fpath);
+                if (!in) throw IO::fileError("Failed to open file", fpath);
+                std::string line;
+                for (size_t number = 1; std::getline(in, line); ++number) {
+                    line = line.substr(0, line.find('#'));
+                    const size_t first = line.find_first_not_of(" \t\r");
+                    if (first == std::string::npos) continue;
+                    const size_t equals = line.find('=');
+                    if (equals == std::string::npos) throw std::invalid_argument(fpath + ":" + std::to_string(number) + ": expected name = value");
+                    auto trim = [](const std::string& text) {
+                        const size_t begin = text.find_first_not_of(" \t\r");
+                        return begin == std::string::npos ? std::string() : text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+                    };
+                    try {
+                        set(config, trim(line.substr(0, equals)), trim(line.substr(equals + 1)));
+                    }
+                    catch (const std::invalid_argument& e) {
+                        throw std::invalid_argument(fpath + ":" + std::to_string(number) + ": " + e.what());
+                    }
+                }
+            }
+
+            // One line per setting with its value in config, e.g. the defaults.
+            void print(std::ostream& out, const SimulationConfig& config) const {
+                for (const auto & name : order) {
+                    const Option& option = options.at(name);
+                    out << "  --" << name << "=" << option.get(config) << "\n      " << option.help << "\n";
+                }
+            }
+        };
+
+        // A parsed command line: the command and its arguments, the config (files first,
+        // then the options given directly, in order) and the parameter sweeps.
+        struct CommandLine {
+            std::string command = "run";
+            std::vector<std::string> args;
+            SimulationConfig config;
+            std::vector<std::pair<std::string, std::vector<std::string>>> sweeps;
+            bool overwrite = false;             // a sweep may replace non-empty sweep-<n> directories
+        };
+
+        // Accepts "--name=value" and "--name value"; "--config <file>" loads a config file
+        // and "--sweep name=v1,v2,..." runs once per value; "--help" and "--overwrite" take
+        // no value. The first other word is the command, the rest are its arguments.
+        // Throws std::invalid_argument on errors.
+        CommandLine parseCommandLine(int argc, char** argv, const Options& options) {
+            CommandLine line;
+            std::vector<std::pair<std::string, std::string>> settings;
+            std::vector<std::string> files;
+            bool haveCommand = false;
+            for (int i = 1; i < argc; ++i) {
+                std::string word = argv[i];
+                if (word.compare(0, 2, "--") != 0) {
+                    if (haveCommand) line.args.push_back(word);
+                    else line.command = word;
+                    haveCommand = true;
+                    continue;
+                }
+                if (word == "--help") {
+                    line.command = "help";
+                    haveCommand = true;
+                    continue;
+                }
+                if (word == "--overwrite") {
+                    line.overwrite = true;
+                    continue;
+                }
+                std::string name = word.substr(2), value;
+                const size_t equals = name.find('=');
+                if (equals != std::string::npos) {
+                    value = name.substr(equals + 1);
+                    name.resize(equals);
+                }
+                else if (i + 1 < argc) value = argv[++i];
+                else throw std::invalid_argument("Missing value for --" + name);
+
+                if (name == "config") files.push_back(value);
+                else if (name == "sweep") {
+                    const size_t assign = value.find('=');
+                    if (assign == std::string::npos) throw std::invalid_argument("Expected --sweep name=v1,v2,...");
+                    std::pair<std::string, std::vector<std::string>> sweep(value.substr(0, assign), std::vector<std::string>());
+                    if (!options.has(sweep.first)) throw std::invalid_argument("Unknown setting " + sweep.first);
+                    std::stringstream values(value.substr(assign + 1));
+                    for (std::string item; std::getline(values, item, ','); ) sweep.second.push_back(item);
+                    if (sweep.second.empty()) throw std::invalid_argument("No values to sweep " + sweep.first + " over");
+                    line.sweeps.push_back(sweep);
+                }
+                else settings.emplace_back(name, value);
+            }
+            for (const auto & file : files) options.load(line.config, file);
+            for (const auto & setting : settings) options.set(line.config, setting.first, setting.second);
+            return line;
+        }
+
+        // Every combination of the sweeps' values, the last sweep varying fastest.
+        std::vector<std::vector<std::pair<std::string, std::string>>> sweepPoints(const std::vector<std::pair<std::string, std::vector<std::string>>>& sweeps) {
+            std::vector<std::vector<std::pair<std::string, std::string>>> points(1);
+            for (const auto & sweep : sweeps) {
+                std::vector<std::vector<std::pair<std::string, std::string>>> next;
+                for (const auto & point : points) {
+                    for (const auto & value : sweep.second) {
+                        next.push_back(point);
+                        next.back().emplace_back(sweep.first, value);
+                    }
+                }
+                points.swap(next);
+            }
+            return points;
+        }
+    }
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace VCoin { namespace IO
+    {
+        std::runtime_error fileError(const std::string& what, const std::string& fpath) {
+            return std::runtime_error(what + " " + fpath + ": " + std::strerror(errno));
+        }
+
+        size_t fileSize(int fd, const std::string& fpath) {
+            struct stat info;
+            if (fstat(fd, &info) != 0) throw fileError("Failed to stat file", fpath);
+            return static_cast<size_t>(info.st_size);
+        }
+
+        void makeDirectory(const std::string& dpath) {
+            if (mkdir(dpath.c_str(), 0755) != 0 && errno != EEXIST) throw fileError("Failed to create directory", dpath);
+        }
+
+        // Names of the entries in a directory, excluding "." and "..".
+        std::vector<std::string> listDirectory(const std::string& dpath) {
+            std::vector<std::string> names;
+            DIR* dir = opendir(dpath.c_str());
+            if (dir == nullptr) throw fileError("Failed to open directory", dpath);
+            while (dirent* entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                if (name != "." && name != "..") names.push_back(name);
+            }
+            closedir(dir);
+            return names;
+        }
+
+        // True if nothing is at the path or it is an empty directory.
+        bool isEmptyOrMissing(const std::string& fpath) {
+            struct stat info;
+            if (lstat(fpath.c_str(), &info) != 0) {
+                if (errno == ENOENT) return true;
+                throw fileError("Failed to stat file", fpath);
+            }
+            return S_ISDIR(info.st_mode) && listDirectory(fpath).empty();
+        }
+
+        // Deletes a file, or a directory and everything in it. A missing path is not an error.
+        void removeTree(const std::string& fpath) {
+            struct stat info;
+            if (lstat(fpath.c_str(), &info) != 0) {
+                if (errno == ENOENT) return;
+                throw fileError("Failed to stat file", fpath);
+            }
+            if (S_ISDIR(info.st_mode)) {
+                for (const auto & name : listDirectory(fpath)) removeTree(fpath + "/" + name);
+                if (rmdir(fpath.c_str()) != 0) throw fileError("Failed to remove directory", fpath);
+            }
+            else if (std::remove(fpath.c_str()) != 0) throw fileError("Failed to remove file", fpath);
+        }
+
+        // Writes the whole buffer, retrying short writes.
+        void writeAll(int fd, const char* data, size_t size, const std::string& fpath) {
+            while (size > 0) {
+                ssize_t written = ::write(fd, data, size);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    throw fileError("Failed to write file", fpath);
+                }
+                data += written;
+                size -= static_cast<size_t>(written);
+            }
+        }
+
+        // A file built under a temporary name and renamed over fpath by commit(), after a
+        // sync, so readers see either the old or the new contents. Dropping it uncommitted
+        // removes the temporary file.
+        class AtomicFile
+        {
+        private:
+            std::string path;
+            std::string tmpPath;
+            int fd = -1;
+
+        public:
+            explicit AtomicFile(const std::string& fpath) : path(fpath), tmpPath(fpath + ".tmp") {
+                fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) throw fileError("Failed to open file", tmpPath);
+            }
+
+            ~AtomicFile() {
+                if (fd < 0) return;
+                ::close(fd);
+                std::remove(tmpPath.c_str());
+            }
+
+            AtomicFile(const AtomicFile&) = delete;
+            AtomicFile& operator=(const AtomicFile&) = delete;
+
+            void write(const char* data, size_t size) {
+                writeAll(fd, data, size, tmpPath);
+            }
+
+            void commit() {
+                if (fsync(fd) != 0) throw fileError("Failed to sync file", tmpPath);
+                ::close(fd);
+                fd = -1;
+                if (std::rename(tmpPath.c_str(), path.c_str()) != 0) throw fileError("Failed to replace file", path);
+            }
+        };
+
+        // Writes the buffer to a temporary file, syncs it and renames it over fpath, so
+        // readers see either the old or the new contents.
+        void writeFileAtomically(const std::string& fpath, const std::string& contents) {
+            AtomicFile file(fpath);
+            file.write(contents.data(), contents.size());
+            file.commit();
+        }
+
+        // Memory mapping of a file. A read-only mapping may reserve more address space than
+        // the file currently holds (mapLength), so a file that only grows by appends never
+        // has to be remapped and pointers into it stay valid; only offsets below the file
+        // size may be read. A writable mapping always covers exactly the file and is grown
+        // with resize(), which invalidates pointers into it.
+        class MappedFile
+        {
+        private:
+            std::string path;
+            int fd = -1;
+            char* _data = nullptr;
+            size_t mapped = 0;
+            size_t _size = 0;
+            bool writable = false;
+
+            void map(size_t length) {
+                if (length == 0) return;
+                int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+                void* address = mmap(nullptr, length, protection, MAP_SHARED, fd, 0);
+                if (address == MAP_FAILED) throw fileError("Failed to map file", path);
+                _data = static_cast<char*>(address);
+                mapped = length;
+            }
+
+            void unmap() {
+                if (_data != nullptr) munmap(_data, mapped);
+                _data = nullptr;
+                mapped = 0;
+            }
+
+        public:
+            MappedFile() {}
+
+            MappedFile(const std::string& fpath, bool writable = false, size_t mapLength = 0) {
+                open(fpath, writable, mapLength);
+            }
+
+            ~MappedFile() {
+                close();
+            }
+
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+
+            MappedFile(MappedFile&& other) noexcept {
+                *this = std::move(other);
+            }
+
+            MappedFile& operator=(MappedFile&& other) noexcept {
+                if (this != &other) {
+                    close();
+                    path = std::move(other.path);
+                    fd = other.fd;
+                    _data = other._data;
+                    mapped = other.mapped;
+                    _size = other._size;
+                    writable = other.writable;
+                    other.fd = -1;
+                    other._data = nullptr;
+                    other.mapped = 0;
+                    other._size = 0;
+                }
+                return *this;
+            }
+
+            // Writable files are created if missing.
+            void open(const std::string& fpath, bool writable = false, size_t mapLength = 0) {
+                close();
+                path = fpath;
+                this->writable = writable;
+                fd = writable ? ::open(fpath.c_str(), O_RDWR | O_CREAT, 0644) : ::open(fpath.c_str(), O_RDONLY);
+                if (fd < 0) throw fileError("Failed to open file", fpath);
+                _size = fileSize(fd, fpath);
+                map(writable ? _size : std::max(_size, mapLength));
+            }
+
+            void close() {
+                unmap();
+                if (fd >= 0) ::close(fd);
+                fd = -1;
+                _size = 0;
+            }
+
+            // Picks up appends made through another descriptor.
+            void refresh() {
+                size_t size = fileSize(fd, path);
+                if (size > mapped) {
+                    unmap();
+                    map(size);
+                }
+                _size = size;
+            }
+
+            void resize(size_t size) {
+                if (!writable) throw std::logic_error("Cannot resize a read-only mapping of " + path);
+                if (ftruncate(fd, static_cast<off_t>(size)) != 0) throw fileError("Failed to resize file", path);
+                unmap();
+                map(size);
+                _size = size;
+            }
+
+            void sync() {
+                if (writable && _data != nullptr && msync(_data, _size, MS_SYNC) != 0) throw fileError("Failed to sync file", path);
+            }
+
+            bool isOpen() const { return fd >= 0; }
+            char* data() { return _data; }
+            const char* data() const { return _data; }
+            size_t size() const { return _size; }
+        };
+
+        // FNV-1a checksum of the data files; pass the previous result as hash to continue it.
+        const uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+
+        uint64_t fnv1a(uint64_t hash, const char* data, size_t size) {
+            for (size_t i = 0; i < size; ++i) {
+                hash ^= static_cast<unsigned char>(data[i]);
+                hash *= 0x100000001b3ULL;
+            }
+            return hash;
+        }
+
+        // Little-endian field access into mapped records, independent of alignment.
+        uint64_t loadU64(const char* at) {
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(at);
+            uint64_t value = 0;
+            for (int i = 0; i < 8; ++i) value |= static_cast<uint64_t>(bytes[i]) << (8*i);
+            return value;
+        }
+
+        uint32_t loadU32(const char* at) {
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(at);
+            uint32_t value = 0;
+            for (int i = 0; i < 4; ++i) value |= static_cast<uint32_t>(bytes[i]) << (8*i);
+            return value;
+        }
+
+        void storeU64(char* at, uint64_t value) {
+            for (int i = 0; i < 8; ++i) at[i] = static_cast<char>((value >> (8*i)) & 0xff);
+        }
+
+        void storeU32(char* at, uint32_t value) {
+            for (int i = 0; i < 4; ++i) at[i] = static_cast<char>((value >> (8*i)) & 0xff);
+        }
+    } }
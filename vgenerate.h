@@ -0,0 +1,416 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <random>
+#include <sstream>
+#include <algorithm>
+#include <ctime>
+#include <cmath>
+#include <stdexcept>
+#include <omp.h>
+#include "vcoin.h"
+#include "vfile.h"
+#include "vbinary.h"
+
+namespace VCoin
+{
+    // Zipf-distributed ranks in [1, n] with exponent s > 0: rank k is drawn with weight
+    // k^-s. Rejection-inversion sampling (Hörmann and Derflinger) takes O(1) expected time
+    // and no tables, so it scales to any number of accounts.
+    class ZipfDistribution
+    {
+    private:
+        size_t n;
+        double exponent;
+        double hIntegralX1;
+        double hIntegralN;
+        double squeeze;
+
+        static double helper1(double x) {
+            return std::fabs(x) > 1e-8 ? std::log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+        }
+
+        static double helper2(double x) {
+            return std::fabs(x) > 1e-8 ? std::expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+        }
+
+        double h(double x) const {
+            return std::exp(-exponent * std::log(x));
+        }
+
+        double hIntegral(double x) const {
+            const double logX = std::log(x);
+            return helper2((1 - exponent) * logX) * logX;
+        }
+
+        double hIntegralInverse(double x) const {
+            return std::exp(helper1(std::max(x * (1 - exponent), -1.0)) * x);
+        }
+
+    public:
+        ZipfDistribution(size_t n, double exponent) : n(std::max<size_t>(n, 1)), exponent(exponent) {
+            if (!(exponent > 0)) throw std::invalid_argument("Zipf exponent must be positive");
+            hIntegralX1 = hIntegral(1.5) - 1;
+            hIntegralN = hIntegral(this->n + 0.5);
+            squeeze = 2 - hIntegralInverse(hIntegral(2.5) - h(2));
+        }
+
+        template <typename Engine>
+        size_t operator()(Engine& engine) const {
+            std::uniform_real_distribution<double> unit(0, 1);
+            while (true) {
+                const double u = hIntegralN + unit(engine) * (hIntegralX1 - hIntegralN);
+                const double x = hIntegralInverse(u);
+                const size_t k = static_cast<size_t>(std::min(std::max(x + 0.5, 1.0), static_cast<double>(n)));
+                if (k - x <= squeeze || u >= hIntegral(k + 0.5) - h(k)) return k;
+            }
+        }
+    };
+
+    enum class Popularity {
+        Uniform,
+        Zipf       // account popularity falls off as rank^-exponent
+    };
+
+    enum class AmountModel {
+        Uniform,
+        Pareto     // heavy-tailed, truncated to [minSum, maxSum] with the given tail index
+    };
+
+    enum class ArrivalModel {
+        Uniform,
+        Bursty,    // a share of arrivals clusters in bursts that start abruptly and decay
+        Trace      // replays recorded arrival times in order, the latest mapped to now
+    };
+
+    // The shape of a generated transaction load. The defaults reproduce the old uniform
+    // generator; the skewed models make hot accounts, whales and bursts appear the way
+    // they do in production traffic.
+    struct WorkloadModel {
+        Popularity senders = Popularity::Uniform;
+        Popularity receivers = Popularity::Uniform;
+        double senderExponent = 1.0;
+        double receiverExponent = 1.0;
+
+        AmountModel amounts = AmountModel::Uniform;
+        double minSum = 1, maxSum = 10000;
+        double tailIndex = 1.16;            // Pareto alpha; 1.16 puts 80% of the volume in 20% of transactions
+
+        ArrivalModel arrivals = ArrivalModel::Uniform;
+        uint32_t maxAge = 3600*7;           // uniform and bursty arrivals fall in [now - maxAge, now]
+        size_t bursts = 16;
+        double burstShare = 0.8;            // fraction of arrivals inside bursts
+        double burstSeconds = 60;           // mean time from a burst's start to its arrivals
+        std::vector<time_t> trace;          // recorded arrival times for ArrivalModel::Trace
+    };
+
+    // Synthetic users and transactions, reproducible from one seed whatever the number of
+    // threads. Work is split into fixed chunks of kChunkSize items and every chunk draws
+    // from its own engine, seeded from (seed, stream, chunk), so chunks are generated and
+    // hashed in parallel in any order. Accounts are picked by index from a key table, in
+    // O(1), and transactions can be written straight to a data file a window of chunks at
+    // a time, so a data set never has to fit in memory at once.
+    class DataGenerator
+    {
+    public:
+        static const size_t kChunkSize = 4096;
+
+    private:
+        static const uint64_t kUserStream = 1;
+        static const uint64_t kTransactionStream = 2;
+        static const uint64_t kBurstStream = 3;
+
+        uint64_t seed;
+
+        // SplitMix64's finalizer; spreads nearby inputs over the whole range.
+        static uint64_t mix(uint64_t x) {
+            x += 0x9e3779b97f4a7c15ULL;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        }
+
+        std::mt19937_64 engine(uint64_t stream, uint64_t chunk) const {
+            return std::mt19937_64(mix(mix(seed ^ mix(stream)) + chunk));
+        }
+
+        static const std::vector<std::string>& names() {
+            static const std::vector<std::string> randNames = {
+                    "Tomas", "Matas", "Danielius", "Augustinas", "Viktoras", "Ernestas", "Adomas", "Darius", "Zydrunas", "Ignas",
+                    "Elena", "Lilija", "Smilte", "Viktorija", "Urte", "Regina", "Kristina", "Leja", "Austeja", "Jolanta"
+            };
+            return randNames;
+        }
+
+        // Distinct (seed, index, attempt) give distinct hash inputs, so keys only collide
+        // if the hash does.
+        std::string userKey(size_t index, uint32_t attempt) const {
+            return VHasher::getHash("user " + std::to_string(seed) + " " + std::to_string(index) + " " + std::to_string(attempt));
+        }
+
+        static size_t chunksOf(size_t count) {
+            return (count + kChunkSize - 1) / kChunkSize;
+        }
+
+        template <typename Generate>
+        static void forEachChunk(size_t firstChunk, size_t chunks, Generate generate) {
+            const long count = static_cast<long>(chunks);
+#pragma omp parallel for schedule(dynamic, 1)
+            for (long i = 0; i < count; ++i) {
+                generate(firstChunk + static_cast<size_t>(i));
+            }
+        }
+
+        // Picks account indexes under a popularity model. Zipf ranks are spread over the
+        // key table by a seeded affine permutation, so the hot accounts are not simply the
+        // smallest keys; senders and receivers share it, so hot accounts are hot both ways.
+        class AccountPicker
+        {
+        private:
+            size_t n;
+            bool zipf;
+            ZipfDistribution ranks;
+            size_t stride;
+            size_t offset;
+
+        public:
+            AccountPicker(size_t n, Popularity popularity, double exponent, uint64_t permutation)
+                    : n(n), zipf(popularity == Popularity::Zipf), ranks(n, zipf ? exponent : 1.0) {
+                stride = n > 1 ? mix(permutation) % n : 1;
+                while (n > 1 && (stride == 0 || gcd(stride, n) != 1)) stride = (stride + 1) % n;
+                offset = n > 0 ? mix(permutation + 1) % n : 0;
+            }
+
+            template <typename Engine>
+            size_t operator()(Engine& engine) const {
+                if (!zipf) return std::uniform_int_distribution<size_t>(0, n - 1)(engine);
+                return static_cast<size_t>((static_cast<uint64_t>(ranks(engine) - 1) * stride + offset) % n);
+            }
+        };
+
+        // What the chunks of one generation share: the pickers and the burst start times.
+        struct Plan {
+            const WorkloadModel& model;
+            const std::vector<std::string>& keys;
+            size_t count;
+            time_t now;
+            AccountPicker senders;
+            AccountPicker receivers;
+            std::vector<time_t> bursts;
+            time_t traceShift = 0;          // moves the latest recorded arrival to now
+            time_t traceSpan = 0;           // a replay of the trace is shifted back this far per later replay
+            size_t traceReplays = 0;
+
+            Plan(const DataGenerator& generator, const WorkloadModel& model, const std::vector<std::string>& keys, size_t count, time_t now)
+                    : model(model), keys(keys), count(count), now(now),
+                      senders(keys.size(), model.senders, model.senderExponent, generator.seed),
+                      receivers(keys.size(), model.receivers, model.receiverExponent, generator.seed) {
+                if (model.amounts == AmountModel::Pareto && !(model.minSum > 0 && model.tailIndex > 0)) {
+                    throw std::invalid_argument("Pareto amounts need a positive minimum sum and tail index");
+                }
+                if (model.arrivals == ArrivalModel::Bursty && model.bursts > 0) {
+                    std::mt19937_64 random = generator.engine(kBurstStream, 0);
+                    std::uniform_int_distribution<uint32_t> start(0, model.maxAge);
+                    for (size_t i = 0; i < model.bursts; ++i) bursts.push_back(now - static_cast<time_t>(start(random)));
+                }
+                if (model.arrivals == ArrivalModel::Trace) {
+                    if (model.trace.empty()) throw std::invalid_argument("Trace arrivals need a recorded trace");
+                    auto range = std::minmax_element(model.trace.begin(), model.trace.end());
+                    traceShift = now - *range.second;
+                    traceSpan = *range.second - *range.first + 1;
+                    traceReplays = (count + model.trace.size() - 1) / model.trace.size();
+                }
+            }
+
+            template <typename Engine>
+            double amount(Engine& random) const {
+                std::uniform_real_distribution<double> unit(0, 1);
+                if (model.amounts == AmountModel::Uniform) return std::uniform_real_distribution<double>(model.minSum, model.maxSum)(random);
+                // Inverse of the Pareto CDF truncated to [minSum, maxSum].
+                const double ratio = std::pow(model.minSum / model.maxSum, model.tailIndex);
+                return model.minSum / std::pow(1 - unit(random) * (1 - ratio), 1 / model.tailIndex);
+            }
+
+            template <typename Engine>
+            time_t arrival(Engine& random, size_t index) const {
+                if (model.arrivals == ArrivalModel::Trace) {
+                    const size_t replay = index / model.trace.size();
+                    return model.trace[index % model.trace.size()] + traceShift - static_cast<time_t>(traceReplays - 1 - replay) * traceSpan;
+                }
+                std::uniform_int_distribution<uint32_t> age(0, model.maxAge);
+                if (model.arrivals == ArrivalModel::Bursty && !bursts.empty() && std::uniform_real_distribution<double>(0, 1)(random) < model.burstShare) {
+                    const time_t start = bursts[std::uniform_int_distribution<size_t>(0, bursts.size() - 1)(random)];
+                    const double delay = std::exponential_distribution<double>(1 / std::max(model.burstSeconds, 1e-9))(random);
+                    return std::min<time_t>(now, start + static_cast<time_t>(delay));
+                }
+                return now - static_cast<time_t>(age(random));
+            }
+        };
+
+        static size_t gcd(size_t a, size_t b) {
+            while (b != 0) {
+                size_t t = a % b;
+                a = b;
+                b = t;
+            }
+            return a;
+        }
+
+        // Fills out[0, size) with the transactions of one chunk. Constructing a transaction
+        // hashes it.
+        template <typename Out>
+        void transactionChunk(size_t chunk, Out out, size_t size, const Plan& plan) const {
+            std::mt19937_64 random = engine(kTransactionStream, chunk);
+            for (size_t i = 0; i < size; ++i) {
+                const std::string& sender = plan.keys[plan.senders(random)];
+                const std::string& receiver = plan.keys[plan.receivers(random)];
+                const double amount = plan.amount(random);
+                const time_t timestamp = plan.arrival(random, chunk * kChunkSize + i);
+                out[i] = VTransaction(sender, receiver, amount, timestamp);
+                out[i].id = out[i].hashHex();
+            }
+        }
+
+    public:
+        explicit DataGenerator(uint64_t seed = 1) : seed(seed) {}
+
+        // count users with distinct keys, in key order.
+        std::vector<VUser> users(size_t count, double minBalance, double maxBalance) const {
+            std::vector<VUser> result(count);
+            forEachChunk(0, chunksOf(count), [&](size_t chunk) {
+                std::mt19937_64 random = engine(kUserStream, chunk);
+                std::uniform_real_distribution<double> balance(minBalance, maxBalance);
+                std::uniform_int_distribution<size_t> name(0, names().size() - 1);
+                const size_t end = std::min(count, (chunk + 1) * kChunkSize);
+                for (size_t i = chunk * kChunkSize; i < end; ++i) {
+                    result[i].key = userKey(i, 0);
+                    result[i].name = names()[name(random)];
+                    result[i].balance = balance(random);
+                }
+            });
+
+            auto byKey = [](const VUser& a, const VUser& b) { return a.key < b.key; };
+            std::sort(result.begin(), result.end(), byKey);
+            // Rekeys the later of two colliding users until every key is distinct.
+            for (uint32_t attempt = 1; ; ++attempt) {
+                bool collided = false;
+                for (size_t i = 1; i < count; ++i) {
+                    if (result[i].key != result[i - 1].key) continue;
+                    result[i].key = userKey(i, attempt);
+                    collided = true;
+                }
+                if (!collided) break;
+                std::sort(result.begin(), result.end(), byKey);
+            }
+            return result;
+        }
+
+        // count transactions between the given accounts under the workload model, with
+        // arrivals relative to now. Throws std::invalid_argument if the model is unusable.
+        VTransactions transactions(const std::vector<std::string>& keys, size_t count, const WorkloadModel& model, time_t now) const {
+            if (keys.empty()) return VTransactions();
+            const Plan plan(*this, model, keys, count, now);
+            VTransactions generated(count);
+            forEachChunk(0, chunksOf(count), [&](size_t chunk) {
+                const size_t begin = chunk * kChunkSize;
+                transactionChunk(chunk, generated.begin() + begin, std::min(kChunkSize, count - begin), plan);
+            });
+            return generated;
+        }
+
+        // Writes the transactions transactions() would return to fpath, as a text (.dat)
+        // or binary (.bin) transactions file, replacing it atomically. Memory use is bounded
+        // by a window of a few chunks per thread.
+        void writeTransactions(const std::string& fpath, bool binary, const std::vector<std::string>& keys, size_t count,
+                               const WorkloadModel& model, time_t now) const {
+            if (keys.empty()) count = 0;
+            const Plan plan(*this, model, keys, count, now);
+            IO::AtomicFile file(fpath);
+            if (binary) {
+                // The header of a file with count records; they follow it window by window.
+                std::string header = IO::RecordFile::create(IO::TransactionFile::kMagic, IO::kTransactionRecordSize, 0);
+                IO::storeU64(&header[8], count);
+                file.write(header.data(), header.size());
+            }
+
+            const size_t chunks = chunksOf(count);
+            const size_t window = 4 * static_cast<size_t>(std::max(omp_get_max_threads(), 1));
+            std::vector<std::string> encoded(window);
+            for (size_t first = 0; first < chunks; first += window) {
+                const size_t windowChunks = std::min(window, chunks - first);
+                forEachChunk(first, windowChunks, [&](size_t chunk) {
+                    const size_t begin = chunk * kChunkSize;
+                    const size_t size = std::min(kChunkSize, count - begin);
+                    std::vector<VTransaction> generated(size);
+                    transactionChunk(chunk, generated.begin(), size, plan);
+
+                    std::string& out = encoded[chunk - first];
+                    if (binary) {
+                        out.assign(size * IO::kTransactionRecordSize, '\0');
+                        for (size_t i = 0; i < size; ++i) IO::storeTransactionRecord(&out[i * IO::kTransactionRecordSize], generated[i]);
+                    }
+                    else {
+                        std::ostringstream text;
+                        text << std::setprecision(std::numeric_limits<double>::max_digits10);
+                        for (const auto & transaction : generated) IO::writeTransaction(text, transaction);
+                        out = text.str();
+                    }
+                });
+                for (size_t i = 0; i < windowChunks; ++i) file.write(encoded[i].data(), encoded[i].size());
+            }
+            file.commit();
+        }
+    };
+
+    // Keys of the users, in key order, for picking accounts by index.
+    std::vector<std::string> userKeys(const VUsers& users) {
+        std::vector<std::string> keys;
+        keys.reserve(users.size());
+        for (const auto & user : users) keys.push_back(user.first);
+        return keys;
+    }
+
+    namespace IO
+    {
+        void genRandUsers(VUsers& users, uint32_t count, double minBalance, double maxBalance, uint64_t seed = 1) {
+            users.clear();
+            for (auto & user : DataGenerator(seed).users(count, minBalance, maxBalance)) {
+                users.emplace_hint(users.end(), user.key, std::move(user));
+            }
+        }
+
+        void genRandTransactions(VTransactions& transactions, const VUsers& users, uint32_t count, double minSum, double maxSum,
+                                 uint32_t maxTransAge, uint64_t seed = 1) {
+            WorkloadModel model;
+            model.minSum = minSum;
+            model.maxSum = maxSum;
+            model.maxAge = maxTransAge;
+            transactions = DataGenerator(seed).transactions(userKeys(users), count, model, std::time(nullptr));
+        }
+
+        // Arrival times recorded in a binary transactions file, or in a text file whose
+        // lines end with a unix time, e.g. a transactions.dat or one timestamp per line.
+        std::vector<time_t> getArrivalTrace(const std::string& fpath) {
+            std::vector<time_t> trace;
+            try {
+                TransactionFile file(fpath);
+                trace.resize(file.size());
+                for (size_t i = 0; i < file.size(); ++i) trace[i] = file.timestamp(i);
+                return trace;
+            }
+            catch (const std::runtime_error&) {}
+
+            MappedFile file(fpath);
+            Text::Lines lines(file.data(), file.size());
+            trace.resize(lines.size());
+            lines.forEach([&trace](size_t index, const char* begin, const char* end) {
+                while (end > begin && Text::isSpace(end[-1])) --end;
+                const char* last = end;
+                while (last > begin && !Text::isSpace(last[-1])) --last;
+                trace[index] = static_cast<time_t>(Text::Fields(last, end).integer());
+            });
+            return trace;
+        }
+    }
+}
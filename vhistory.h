@@ -0,0 +1,387 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+#include "vcoin.h"
+#include "vfile.h"
+
+namespace VCoin
+{
+    const size_t kDefaultCheckpointInterval = 64;
+
+    // One transfer in an account's history; amount is negative when the account sent it.
+    struct HistoryEntry {
+        uint64_t height;
+        uint32_t position;
+        std::string counterparty;
+        double amount;
+    };
+
+    // A page of history, oldest first. next is the cursor to pass for the following page.
+    struct HistoryPage {
+        std::vector<HistoryEntry> entries;
+        size_t next = 0;
+        bool more = false;
+    };
+
+    // Append-only per-account history of the active chain. history.dat holds fixed-size
+    // records in chain order: a delta per side of every transfer and, every
+    // checkpointInterval deltas of an account, a checkpoint with its full balance.
+    // accounts.dat maps the records' account ids to keys. Each account's record offsets
+    // are kept in memory, so its balance at any height is a binary search plus at most
+    // checkpointInterval deltas replayed in ledger order, giving the exact balance bits,
+    // and history pages are read in place. As a chain observer it truncates the log back
+    // to the fork on reorgs. Opening scans the log once. Thread-safe.
+    class AccountHistory : public ChainObserver
+    {
+    private:
+        static const uint32_t kMagic = 0x53494856;   // "VHIS"
+        static const uint32_t kVersion = 1;
+        static const size_t kHeaderSize = 64;        // magic, version, capacity, count, indexed, tip digest
+        static const size_t kRecordSize = 32;        // height, account, counterparty, position, kind, amount
+        static const uint64_t kInitialCapacity = 4096;
+
+        enum RecordKind : uint32_t { kSent = 1, kReceived = 2, kCheckpoint = 3 };
+
+        struct Record {
+            uint64_t height;
+            uint32_t account;
+            uint32_t counterparty;
+            uint32_t position;
+            uint32_t kind;
+            double amount;
+        };
+
+        struct Account {
+            std::vector<uint64_t> records; // indexes into history.dat, in chain order
+            double balance = 0;
+            size_t sinceCheckpoint = 0;
+        };
+
+        std::string directory;
+        size_t checkpointInterval;
+        IO::MappedFile log;
+        int accountsFd = -1;
+        std::vector<std::string> keys;
+        std::unordered_map<std::string, uint32_t> ids;
+        std::vector<Account> accounts;
+        mutable std::mutex mutex;
+
+        uint64_t capacity() const { return IO::loadU64(log.data() + 8); }
+        uint64_t count() const { return IO::loadU64(log.data() + 16); }
+        void setCount(uint64_t count) { IO::storeU64(log.data() + 16, count); }
+        uint64_t indexedLocked() const { return IO::loadU64(log.data() + 24); }
+
+        Record record(uint64_t index) const {
+            const char* at = log.data() + kHeaderSize + index * kRecordSize;
+            Record record;
+            record.height = IO::loadU64(at);
+            record.account = IO::loadU32(at + 8);
+            record.counterparty = IO::loadU32(at + 12);
+            record.position = IO::loadU32(at + 16);
+            record.kind = IO::loadU32(at + 20);
+            uint64_t bits = IO::loadU64(at + 24);
+            std::memcpy(&record.amount, &bits, sizeof(bits));
+            return record;
+        }
+
+        uint64_t heightOf(uint64_t index) const {
+            return IO::loadU64(log.data() + kHeaderSize + index * kRecordSize);
+        }
+
+        void setTip(uint64_t indexed, const std::string& hash) {
+            IO::storeU64(log.data() + 24, indexed);
+            bc::hash_digest digest = bc::null_hash;
+            if (indexed > 0 && !decodeHash(hash, digest)) throw std::invalid_argument("Not a block hash: " + hash);
+            std::memcpy(log.data() + 32, digest.data(), digest.size());
+        }
+
+        std::string tipLocked() const {
+            bc::hash_digest digest;
+            std::memcpy(digest.data(), log.data() + 32, digest.size());
+            return bc::encode_base16(digest);
+        }
+
+        static void apply(double& balance, const Record& record) {
+            if (record.kind == kSent) balance -= record.amount;
+            else if (record.kind == kReceived) balance += record.amount;
+            else balance = record.amount;
+        }
+
+        void append(const Record& record) {
+            const uint64_t index = count();
+            if (index == capacity()) {
+                log.resize(kHeaderSize + capacity() * 2 * kRecordSize);
+                IO::storeU64(log.data() + 8, capacity() * 2);
+            }
+            char* at = log.data() + kHeaderSize + index * kRecordSize;
+            IO::storeU64(at, record.height);
+            IO::storeU32(at + 8, record.account);
+            IO::storeU32(at + 12, record.counterparty);
+            IO::storeU32(at + 16, record.position);
+            IO::storeU32(at + 20, record.kind);
+            uint64_t bits;
+            std::memcpy(&bits, &record.amount, sizeof(bits));
+            IO::storeU64(at + 24, bits);
+            setCount(index + 1);
+            accounts[record.account].records.push_back(index);
+        }
+
+        uint32_t idOf(const std::string& key) {
+            auto it = ids.find(key);
+            if (it != ids.end()) return it->second;
+            std::string entry;
+            Serial::putString(entry, key);
+            IO::writeAll(accountsFd, entry.data(), entry.size(), directory + "/accounts.dat");
+            const uint32_t id = static_cast<uint32_t>(keys.size());
+            keys.push_back(key);
+            ids.emplace(key, id);
+            accounts.emplace_back();
+            return id;
+        }
+
+        // Appends one side of a transfer, opening the account with a zero checkpoint
+        // the first time it appears, as the ledger creates it with a zero balance.
+        void addDelta(uint32_t account, uint32_t counterparty, uint64_t height, uint32_t position, RecordKind kind, double amount) {
+            Account& state = accounts[account];
+            if (state.records.empty()) {
+                append(Record{height, account, account, position, kCheckpoint, 0});
+                state.balance = 0;
+                state.sinceCheckpoint = 0;
+            }
+            Record delta{height, account, counterparty, position, kind, amount};
+            append(delta);
+            apply(state.balance, delta);
+            if (++state.sinceCheckpoint >= checkpointInterval) {
+                append(Record{height, account, account, position, kCheckpoint, state.balance});
+                state.sinceCheckpoint = 0;
+            }
+        }
+
+        void addBlockLocked(uint64_t height, const VBlock& block) {
+            for (size_t i = 0; i < block.transactions.size(); ++i) {
+                const VTransaction& transaction = block.transactions[i];
+                const uint32_t sender = idOf(transaction.sender());
+                const uint32_t receiver = idOf(transaction.receiver());
+                const uint32_t position = static_cast<uint32_t>(i);
+                addDelta(sender, receiver, height, position, kSent, transaction.sum());
+                addDelta(receiver, sender, height, position, kReceived, transaction.sum());
+            }
+        }
+
+        // Balance after the account's record at slot, from the nearest checkpoint before it.
+        double balanceThrough(const Account& account, size_t slot) const {
+            size_t start = slot;
+            while (record(account.records[start]).kind != kCheckpoint) --start;
+            double balance = 0;
+            for (size_t k = start; k <= slot; ++k) {
+                apply(balance, record(account.records[k]));
+            }
+            return balance;
+        }
+
+        // Number of the account's records at heights <= height.
+        size_t recordsThrough(const Account& account, uint64_t height) const {
+            auto it = std::upper_bound(account.records.begin(), account.records.end(), height,
+                                       [this](uint64_t h, uint64_t index) { return h < heightOf(index); });
+            return static_cast<size_t>(it - account.records.begin());
+        }
+
+        // Drops every record at heights >= height and restores the affected balances.
+        void rollbackLocked(uint64_t height) {
+            uint64_t low = 0, high = count();
+            while (low < high) {
+                uint64_t mid = low + (high - low) / 2;
+                if (heightOf(mid) < height) low = mid + 1;
+                else high = mid;
+            }
+            std::vector<uint32_t> touched;
+            for (uint64_t index = low; index < count(); ++index) {
+                uint32_t account = record(index).account;
+                Account& state = accounts[account];
+                if (!state.records.empty() && state.records.back() >= low) touched.push_back(account);
+                while (!state.records.empty() && state.records.back() >= low) state.records.pop_back();
+            }
+            setCount(low);
+            for (uint32_t account : touched) {
+                Account& state = accounts[account];
+                state.balance = 0;
+                state.sinceCheckpoint = 0;
+                if (state.records.empty()) continue;
+                state.balance = balanceThrough(state, state.records.size() - 1);
+                for (size_t k = state.records.size(); k-- > 0 && record(state.records[k]).kind != kCheckpoint; ) {
+                    state.sinceCheckpoint++;
+                }
+            }
+        }
+
+        void load() {
+            std::string contents;
+            const std::string accountsPath = directory + "/accounts.dat";
+            {
+                IO::MappedFile file(accountsPath, true);
+                contents.assign(file.data() ? file.data() : "", file.size());
+            }
+            Serial::Reader in(contents.data(), contents.size());
+            while (in.remaining() > 0) {
+                std::string key = in.getString();
+                ids.emplace(key, static_cast<uint32_t>(keys.size()));
+                keys.push_back(key);
+            }
+            accounts.resize(keys.size());
+            for (uint64_t index = 0; index < count(); ++index) {
+                Record entry = record(index);
+                if (entry.account >= accounts.size()) throw std::runtime_error("History record " + std::to_string(index) + " has an unknown account");
+                Account& state = accounts[entry.account];
+                state.records.push_back(index);
+                apply(state.balance, entry);
+                state.sinceCheckpoint = entry.kind == kCheckpoint ? 0 : state.sinceCheckpoint + 1;
+            }
+        }
+
+    public:
+        explicit AccountHistory(const std::string& directory, size_t checkpointInterval = kDefaultCheckpointInterval)
+                : directory(directory), checkpointInterval(std::max<size_t>(checkpointInterval, 1)) {
+            IO::makeDirectory(directory);
+            const std::string fpath = directory + "/history.dat";
+            log.open(fpath, true);
+            if (log.size() == 0) {
+                log.resize(kHeaderSize + kInitialCapacity * kRecordSize);
+                IO::storeU32(log.data(), kMagic);
+                IO::storeU32(log.data() + 4, kVersion);
+                IO::storeU64(log.data() + 8, kInitialCapacity);
+            }
+            if (IO::loadU32(log.data()) != kMagic || IO::loadU32(log.data() + 4) != kVersion) {
+                throw std::runtime_error("Unrecognized history file " + fpath);
+            }
+            load();
+            const std::string accountsPath = directory + "/accounts.dat";
+            accountsFd = ::open(accountsPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (accountsFd < 0) throw IO::fileError("Failed to open account file", accountsPath);
+        }
+
+        ~AccountHistory() {
+            if (accountsFd >= 0) ::close(accountsFd);
+        }
+
+        AccountHistory(const AccountHistory&) = delete;
+        AccountHistory& operator=(const AccountHistory&) = delete;
+
+        bool empty() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return count() == 0;
+        }
+
+        // Records the genesis balances as height 0 checkpoints of a new history; the
+        // genesis block itself carries no transfers.
+        void initialize(const VUsers& genesisLedger, const std::string& genesisHash) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (count() != 0) throw std::logic_error("History is already initialized");
+            for (const auto & user : genesisLedger) {
+                uint32_t id = idOf(user.first);
+                append(Record{0, id, id, 0, kCheckpoint, user.second.balance});
+                accounts[id].balance = user.second.balance;
+            }
+            setTip(1, genesisHash);
+        }
+
+        // Number of active blocks the history is current to.
+        size_t indexedHeight() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return indexedLocked();
+        }
+
+        // Appends the chain's blocks the history has not seen, first rolling back to the
+        // fork if the chain no longer contains the block it was current to. Blocks are
+        // loaded in parallel batches and applied in order. Must not run while the chain
+        // notifies this history of inserts. Returns the number of blocks added.
+        size_t catchUp(const ChainSnapshot& chain) {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t from = indexedLocked();
+            if (from == 0) throw std::logic_error("History is not initialized");
+            if (from > chain.size() || chain.hashAt(from - 1) != tipLocked()) {
+                // Genesis is shared, so at worst everything after it is replayed.
+                rollbackLocked(1);
+                from = 1;
+            }
+            if (from < chain.prunedHeight()) throw std::runtime_error("History is behind the pruned height of the chain");
+
+            const size_t kBatch = 256;
+            size_t added = 0;
+            for (uint64_t first = from; first < chain.size(); first += kBatch) {
+                const size_t blocks = static_cast<size_t>(std::min<uint64_t>(kBatch, chain.size() - first));
+                std::vector<VBlockHandle> loaded(blocks);
+                const long total = static_cast<long>(blocks);
+#pragma omp parallel for schedule(dynamic, 1)
+                for (long i = 0; i < total; ++i) {
+                    loaded[i] = chain.at(first + i);
+                }
+                for (size_t i = 0; i < blocks; ++i) {
+                    addBlockLocked(first + i, *loaded[i]);
+                }
+                added += blocks;
+            }
+            setTip(chain.size(), chain.head());
+            return added;
+        }
+
+        // Balance after the active block at height. Returns false if the account did not
+        // exist yet.
+        bool balanceAt(const std::string& key, uint64_t height, double& balance) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto id = ids.find(key);
+            if (id == ids.end()) return false;
+            const Account& account = accounts[id->second];
+            size_t through = recordsThrough(account, height);
+            if (through == 0) return false;
+            balance = balanceThrough(account, through - 1);
+            return true;
+        }
+
+        // Cursor of the account's first transfer at or after height, for history().
+        size_t cursorAt(const std::string& key, uint64_t height) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto id = ids.find(key);
+            if (id == ids.end() || height == 0) return 0;
+            return recordsThrough(accounts[id->second], height - 1);
+        }
+
+        // Up to limit transfers starting at cursor (0 for the oldest).
+        HistoryPage history(const std::string& key, size_t cursor, size_t limit) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            HistoryPage page;
+            auto id = ids.find(key);
+            if (id == ids.end()) return page;
+            const Account& account = accounts[id->second];
+            size_t slot = cursor;
+            for (; slot < account.records.size() && page.entries.size() < limit; ++slot) {
+                Record entry = record(account.records[slot]);
+                if (entry.kind == kCheckpoint) continue;
+                page.entries.push_back(HistoryEntry{entry.height, entry.position, keys[entry.counterparty],
+                                                    entry.kind == kSent ? -entry.amount : entry.amount});
+            }
+            while (slot < account.records.size() && record(account.records[slot]).kind == kCheckpoint) ++slot;
+            page.next = slot;
+            page.more = slot < account.records.size();
+            return page;
+        }
+
+        void sync() override {
+            std::lock_guard<std::mutex> lock(mutex);
+            log.sync();
+            if (fsync(accountsFd) != 0) throw IO::fileError("Failed to sync account file", directory + "/accounts.dat");
+        }
+
+        void activeChainChanged(size_t firstHeight, const ChainUpdate& update) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (indexedLocked() == 0) return;
+            if (!update.disconnected.empty()) rollbackLocked(firstHeight);
+            for (size_t i = 0; i < update.connected.size(); ++i) {
+                addBlockLocked(firstHeight + i, *update.connected[i].block);
+            }
+            if (!update.connected.empty()) setTip(firstHeight + update.connected.size(), update.connected.back().hash);
+        }
+    };
+}
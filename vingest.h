@@ -0,0 +1,231 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include "vcoin.h"
+#include "vfile.h"
+#include "vbinary.h"
+#include "vmempool.h"
+
+namespace VCoin { namespace IO
+    {
+        // Reads a transactions file, text (.dat) or binary (.bin), a bounded batch at a time
+        // so files of any size can be consumed at a constant memory footprint. Text files end
+        // at their first empty line, like getTransactionsFromFile; a line may be any length,
+        // the buffer grows to hold it. Batches are parsed and hashed in parallel.
+        class TransactionStream
+        {
+        private:
+            static const size_t kReadBytes = 1 << 20;
+
+            std::string path;
+            int fd = -1;
+            bool binary = false;
+            bool finished = false;
+            uint64_t _read = 0;
+
+            // Text: the unparsed bytes are buffer[begin, end).
+            std::vector<char> buffer;
+            size_t begin = 0;
+            size_t end = 0;
+            bool eof = false;
+
+            // Binary: records left and the offset of the next one.
+            uint64_t remaining = 0;
+            uint64_t offset = 0;
+
+            void readAt(char* data, size_t size, uint64_t at) {
+                while (size > 0) {
+                    ssize_t count = ::pread(fd, data, size, static_cast<off_t>(at));
+                    if (count < 0 && errno == EINTR) continue;
+                    if (count <= 0) throw fileError("Failed to read file", path);
+                    data += count;
+                    at += static_cast<uint64_t>(count);
+                    size -= static_cast<size_t>(count);
+                }
+            }
+
+            // Moves the unparsed bytes to the front and reads more after them.
+            void fill() {
+                if (begin > 0) {
+                    std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                    end -= begin;
+                    begin = 0;
+                }
+                if (end == buffer.size()) buffer.resize(buffer.size() * 2);
+                ssize_t count;
+                do count = ::read(fd, buffer.data() + end, buffer.size() - end);
+                while (count < 0 && errno == EINTR);
+                if (count < 0) throw fileError("Failed to read file", path);
+                if (count == 0) eof = true;
+                end += static_cast<size_t>(count);
+            }
+
+            size_t nextText(VTransactions& batch, size_t maxCount) {
+                // Complete lines are collected from the buffer; it is only refilled, which
+                // moves its contents, before the first one.
+                std::vector<std::pair<size_t, size_t>> lines;
+                size_t cursor = begin;
+                while (lines.size() < maxCount) {
+                    const char* newline = static_cast<const char*>(std::memchr(buffer.data() + cursor, '\n', end - cursor));
+                    if (newline == nullptr) {
+                        if (!lines.empty()) break;
+                        if (!eof) {
+                            fill();
+                            cursor = begin;
+                            continue;
+                        }
+                        if (cursor < end) lines.emplace_back(cursor, end);
+                        cursor = end;
+                        finished = true;
+                        break;
+                    }
+                    const size_t lineEnd = static_cast<size_t>(newline - buffer.data());
+                    if (lineEnd == cursor) {
+                        finished = true;
+                        break;
+                    }
+                    lines.emplace_back(cursor, lineEnd);
+                    cursor = lineEnd + 1;
+                }
+                begin = cursor;
+
+                const size_t first = batch.size();
+                batch.resize(first + lines.size());
+                const char* data = buffer.data();
+                const long count = static_cast<long>(lines.size());
+#pragma omp parallel for schedule(dynamic, 64)
+                for (long i = 0; i < count; ++i) {
+                    batch[first + i] = parseTransactionLine(data + lines[i].first, data + lines[i].second);
+                }
+                return lines.size();
+            }
+
+            size_t nextBinary(VTransactions& batch, size_t maxCount) {
+                const size_t records = static_cast<size_t>(std::min<uint64_t>(remaining, maxCount));
+                buffer.resize(records * kTransactionRecordSize);
+                if (records > 0) readAt(buffer.data(), buffer.size(), offset);
+                offset += buffer.size();
+                remaining -= records;
+                if (remaining == 0) finished = true;
+
+                const size_t first = batch.size();
+                batch.resize(first + records);
+                const char* data = buffer.data();
+                const long count = static_cast<long>(records);
+#pragma omp parallel for schedule(dynamic, 64)
+                for (long i = 0; i < count; ++i) {
+                    batch[first + i] = loadTransactionRecord(data + i * kTransactionRecordSize);
+                }
+                return records;
+            }
+
+        public:
+            // Binary files are recognized by their header. Throws std::runtime_error if the
+            // file cannot be read or is a damaged binary file.
+            explicit TransactionStream(const std::string& fpath) : path(fpath) {
+                fd = ::open(fpath.c_str(), O_RDONLY);
+                if (fd < 0) throw fileError("Failed to open file", fpath);
+                const size_t size = fileSize(fd, fpath);
+                char header[RecordFile::kHeaderSize];
+                if (size >= sizeof(header)) {
+                    readAt(header, sizeof(header), 0);
+                    binary = loadU32(header) == TransactionFile::kMagic;
+                }
+                if (binary) {
+                    if (loadU32(header + 4) != RecordFile::kVersion || loadU32(header + 16) != kTransactionRecordSize) {
+                        throw std::runtime_error("Unrecognized binary file " + fpath);
+                    }
+                    remaining = loadU64(header + 8);
+                    offset = sizeof(header);
+                    if (size != offset + remaining * kTransactionRecordSize) throw std::runtime_error("Truncated binary file " + fpath);
+                    finished = remaining == 0;
+                }
+                else buffer.resize(kReadBytes);
+            }
+
+            ~TransactionStream() {
+                if (fd >= 0) ::close(fd);
+            }
+
+            TransactionStream(const TransactionStream&) = delete;
+            TransactionStream& operator=(const TransactionStream&) = delete;
+
+            // Appends up to maxCount transactions to batch and returns how many; fewer than
+            // maxCount does not mean the end, done() does.
+            size_t next(VTransactions& batch, size_t maxCount) {
+                if (finished || maxCount == 0) return 0;
+                size_t count = binary ? nextBinary(batch, maxCount) : nextText(batch, maxCount);
+                _read += count;
+                return count;
+            }
+
+            bool done() const {
+                return finished;
+            }
+
+            // Transactions returned so far.
+            uint64_t consumed() const {
+                return _read;
+            }
+        };
+    } }
+
+namespace VCoin
+{
+    struct IngestStats {
+        uint64_t read = 0;      // transactions taken from the stream
+        uint64_t invalid = 0;   // failed id validation
+        uint64_t skipped = 0;   // rejected by the caller, e.g. already on the chain
+        uint64_t added = 0;     // entered the pool
+        uint64_t batches = 0;
+    };
+
+    // Feeds a Mempool from a TransactionStream on demand, so a transaction log larger than
+    // memory can be mined through a pool capped at its byte budget. Each batch's ids are
+    // checked with validateTransactions as it is read, so nothing outlives the batch.
+    class StreamIngestor
+    {
+    private:
+        IO::TransactionStream stream;
+        size_t batchSize;
+        IngestStats _stats;
+
+    public:
+        explicit StreamIngestor(const std::string& fpath, size_t batchSize = 4096) : stream(fpath), batchSize(std::max<size_t>(batchSize, 1)) {}
+
+        // Adds batches until the pool holds targetBytes or the stream ends. Transactions
+        // for which skip returns true are left out. Returns the number added.
+        template <typename Skip>
+        size_t topUp(Mempool& mempool, size_t targetBytes, Skip skip) {
+            size_t added = 0;
+            VTransactions batch;
+            while (mempool.bytes() < targetBytes && !stream.done()) {
+                batch.clear();
+                size_t read = stream.next(batch, batchSize);
+                if (read == 0) continue;
+                _stats.batches++;
+                _stats.read += read;
+                _stats.invalid += validateTransactions(batch);
+                for (auto & transaction : batch) {
+                    if (skip(transaction)) {
+                        _stats.skipped++;
+                        continue;
+                    }
+                    if (mempool.add(std::move(transaction))) added++;
+                }
+            }
+            _stats.added += added;
+            return added;
+        }
+
+        bool exhausted() const {
+            return stream.done();
+        }
+
+        const IngestStats& stats() const {
+            return _stats;
+        }
+    };
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include "vcoin.h"
+#include "vfile.h"
+#include "vbinary.h"
+#include "vmempool.h"
+
+namespace VCoin
+{
+    // Write-ahead journal over the binary data files (users.bin, transactions.bin), so
+    // persisting a block costs O(block) instead of rewriting both files. Each record holds
+    // what one active chain change did to the state: the balances of the accounts it
+    // touched after it, the accounts it removed, and the transactions that entered and
+    // left the pool, tagged with the new tip. Every compactInterval records the state is
+    // written to the data files in full and the journal starts over.
+    //
+    // The journal is a 64-byte header { magic, version, base block digest[32] } followed
+    // by records { magic, body length, checksum, body }. Records are encoded by record()
+    // and written in batches by a PersistenceQueue; a torn or corrupt tail left by a crash
+    // is dropped on load. Every operation sets a value rather than adjusting it, so
+    // replaying records over data files that already include them, as after a crash
+    // during compaction, is harmless.
+    class StateJournal
+    {
+    private:
+        static const uint32_t kMagic = 0x4c4e4a56;         // "VJNL"
+        static const uint32_t kRecordMagic = 0x43524a56;   // "VJRC"
+        static const uint32_t kVersion = 1;
+        static const size_t kHeaderSize = 64;
+        static const size_t kRecordHeaderSize = 16;        // magic, body length, checksum
+        static const size_t kBodyHeaderSize = 48;          // block digest, counts of the four sections
+
+        std::string path;
+        std::string usersPath;
+        std::string transactionsPath;
+        size_t compactInterval;
+        int fd = -1;
+        size_t _records = 0;
+        std::string _blockHash;
+
+        void openForAppend() {
+            if (fd >= 0) return;
+            fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+            if (fd < 0) throw IO::fileError("Failed to open file", path);
+        }
+
+        void closeFile() {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+
+        static void storeDigest(char* at, const std::string& blockHash) {
+            bc::hash_digest digest;
+            if (!decodeHash(blockHash, digest)) throw std::invalid_argument("Not a block hash: " + blockHash);
+            std::memcpy(at, digest.data(), digest.size());
+        }
+
+        static std::string loadDigest(const char* at) {
+            bc::hash_digest digest;
+            std::memcpy(digest.data(), at, digest.size());
+            return bc::encode_base16(digest);
+        }
+
+        // Keys whose balance an update may have changed.
+        static std::vector<std::string> touchedKeys(const ChainUpdate& update) {
+            std::unordered_set<std::string> seen;
+            std::vector<std::string> keys;
+            for (const auto * blocks : { &update.disconnected, &update.connected }) {
+                for (const auto & block : *blocks) {
+                    for (const auto & transaction : block.block->transactions) {
+                        if (seen.insert(transaction.sender()).second) keys.push_back(transaction.sender());
+                        if (seen.insert(transaction.receiver()).second) keys.push_back(transaction.receiver());
+                    }
+                }
+            }
+            return keys;
+        }
+
+        // Applies one record body to the users and collects its pool changes, a null entry
+        // being a removal. Returns the record's tip.
+        static std::string replay(const char* body, VUsers& users,
+                                  std::unordered_map<std::string, std::unique_ptr<VTransaction>>& pool) {
+            const char* at = body + 32;
+            const uint32_t updated = IO::loadU32(at), erased = IO::loadU32(at + 4);
+            const uint32_t added = IO::loadU32(at + 8), removed = IO::loadU32(at + 12);
+            at = body + kBodyHeaderSize;
+            for (uint32_t i = 0; i < updated; ++i, at += IO::kUserRecordSize) {
+                VUser user = IO::loadUserRecord(at);
+                users[user.key] = user;
+            }
+            for (uint32_t i = 0; i < erased; ++i, at += IO::kUserKeySize) {
+                users.erase(IO::loadField(at, IO::kUserKeySize));
+            }
+            for (uint32_t i = 0; i < added; ++i, at += IO::kTransactionRecordSize) {
+                VTransaction transaction = IO::loadTransactionRecord(at);
+                std::string id = transaction.id;
+                pool[id].reset(new VTransaction(std::move(transaction)));
+            }
+            for (uint32_t i = 0; i < removed; ++i, at += IO::kTransactionIdSize) {
+                pool[IO::loadField(at, IO::kTransactionIdSize)].reset();
+            }
+            return loadDigest(body);
+        }
+
+        static size_t bodySize(const char* body) {
+            const char* at = body + 32;
+            return kBodyHeaderSize + IO::loadU32(at) * IO::kUserRecordSize + IO::loadU32(at + 4) * IO::kUserKeySize
+                   + IO::loadU32(at + 8) * IO::kTransactionRecordSize + IO::loadU32(at + 12) * IO::kTransactionIdSize;
+        }
+
+    public:
+        StateJournal(const std::string& fpath, const std::string& usersPath, const std::string& transactionsPath, size_t compactInterval = 64)
+                : path(fpath), usersPath(usersPath), transactionsPath(transactionsPath), compactInterval(std::max<size_t>(compactInterval, 1)) {}
+
+        ~StateJournal() {
+            closeFile();
+        }
+
+        StateJournal(const StateJournal&) = delete;
+        StateJournal& operator=(const StateJournal&) = delete;
+
+        // Active block the journaled state is current to, empty if there is no journal.
+        const std::string& blockHash() const {
+            return _blockHash;
+        }
+
+        size_t records() const {
+            return _records;
+        }
+
+        // Reads the data files and replays the journal over them, truncating a torn tail.
+        // Returns false, leaving the plain data files' contents, if there is no journal.
+        bool load(VUsers& users, VTransactions& transactions) {
+            closeFile();
+            users = access(usersPath.c_str(), F_OK) == 0 ? IO::getUsersFromBinaryFile(usersPath) : VUsers();
+            transactions = IO::getTransactionsFromBinaryFile(transactionsPath);
+            _records = 0;
+            _blockHash.clear();
+            if (access(path.c_str(), F_OK) != 0) return false;
+
+            IO::MappedFile file(path);
+            const char* data = file.data();
+            if (file.size() < kHeaderSize || IO::loadU32(data) != kMagic || IO::loadU32(data + 4) != kVersion) {
+                throw std::runtime_error("Unrecognized state journal " + path);
+            }
+            _blockHash = loadDigest(data + 8);
+
+            std::unordered_map<std::string, std::unique_ptr<VTransaction>> pool;
+            size_t offset = kHeaderSize;
+            while (offset + kRecordHeaderSize + kBodyHeaderSize <= file.size()) {
+                const char* record = data + offset;
+                const char* body = record + kRecordHeaderSize;
+                const size_t length = IO::loadU32(record + 4);
+                if (IO::loadU32(record) != kRecordMagic || length < kBodyHeaderSize || offset + kRecordHeaderSize + length > file.size() ||
+                    IO::loadU64(record + 8) != IO::fnv1a(IO::kFnvOffsetBasis, body, length) || bodySize(body) != length) break;
+                _blockHash = replay(body, users, pool);
+                offset += kRecordHeaderSize + length;
+                _records++;
+            }
+            if (offset != file.size()) {
+                std::cerr << "Dropping " << file.size() - offset << " bytes of incomplete records from " << path << "\n";
+                if (truncate(path.c_str(), static_cast<off_t>(offset)) != 0) throw IO::fileError("Failed to truncate file", path);
+            }
+
+            if (!pool.empty()) {
+                VTransactions merged;
+                for (auto & transaction : transactions) {
+                    if (!pool.count(transaction.id)) merged.push_back(std::move(transaction));
+                }
+                for (auto & entry : pool) {
+                    if (entry.second) merged.push_back(std::move(*entry.second));
+                }
+                transactions.swap(merged);
+            }
+            return true;
+        }
+
+        // Writes the state in full to the data files and empties the journal. Pool is a
+        // VTransactions or a Mempool.
+        template <typename Pool>
+        void compact(const VUsers& users, const Pool& transactions, const std::string& blockHash) {
+            IO::writeUsersToBinaryFile(usersPath, users);
+            IO::writeTransactionsToBinaryFile(transactionsPath, transactions);
+            std::string header(kHeaderSize, '\0');
+            IO::storeU32(&header[0], kMagic);
+            IO::storeU32(&header[4], kVersion);
+            storeDigest(&header[8], blockHash);
+            closeFile();
+            IO::writeFileAtomically(path, header);
+            _records = 0;
+            _blockHash = blockHash;
+        }
+
+        // Encodes the record of an active chain change, given the balances after it and the
+        // pool's changes; empty if the update connected nothing. Touches no file, so records
+        // can be built where the state lives and written elsewhere.
+        std::string record(const ChainUpdate& update, const VUsers& users, const MempoolChanges& changes) const {
+            if (update.connected.empty()) return std::string();
+            const std::string& tipHash = update.connected.back().hash;
+
+            std::vector<const VUser*> updated;
+            std::vector<const std::string*> erased;
+            std::vector<std::string> keys = touchedKeys(update);
+            for (const auto & key : keys) {
+                auto user = users.find(key);
+                if (user != users.end()) updated.push_back(&user->second);
+                else erased.push_back(&key);
+            }
+
+            const size_t length = kBodyHeaderSize + updated.size() * IO::kUserRecordSize + erased.size() * IO::kUserKeySize
+                                  + changes.added.size() * IO::kTransactionRecordSize + changes.removed.size() * IO::kTransactionIdSize;
+            std::string encoded(kRecordHeaderSize + length, '\0');
+            char* body = &encoded[kRecordHeaderSize];
+            storeDigest(body, tipHash);
+            IO::storeU32(body + 32, static_cast<uint32_t>(updated.size()));
+            IO::storeU32(body + 36, static_cast<uint32_t>(erased.size()));
+            IO::storeU32(body + 40, static_cast<uint32_t>(changes.added.size()));
+            IO::storeU32(body + 44, static_cast<uint32_t>(changes.removed.size()));
+            char* at = body + kBodyHeaderSize;
+            for (auto user : updated) {
+                IO::storeUserRecord(at, *user);
+                at += IO::kUserRecordSize;
+            }
+            for (auto key : erased) {
+                IO::storeField(at, *key, IO::kUserKeySize, "User key");
+                at += IO::kUserKeySize;
+            }
+            for (const auto & transaction : changes.added) {
+                IO::storeTransactionRecord(at, transaction);
+                at += IO::kTransactionRecordSize;
+            }
+            for (const auto & id : changes.removed) {
+                IO::storeField(at, id, IO::kTransactionIdSize, "Transaction id");
+                at += IO::kTransactionIdSize;
+            }
+            IO::storeU32(&encoded[0], kRecordMagic);
+            IO::storeU32(&encoded[4], static_cast<uint32_t>(length));
+            IO::storeU64(&encoded[8], IO::fnv1a(IO::kFnvOffsetBasis, body, length));
+            return encoded;
+        }
+
+        // Appends count encoded records, the last of them for tipHash, in one write.
+        void write(const std::string& records, size_t count, const std::string& tipHash, bool sync) {
+            if (records.empty()) return;
+            openForAppend();
+            IO::writeAll(fd, records.data(), records.size(), path);
+            if (sync) this->sync();
+            _records += count;
+            _blockHash = tipHash;
+        }
+
+        void sync() {
+            if (fd >= 0 && fdatasync(fd) != 0) throw IO::fileError("Failed to sync file", path);
+        }
+
+        // Records per compaction.
+        size_t interval() const {
+            return compactInterval;
+        }
+    };
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <set>
+#include <unordered_map>
+#include "vcoin.h"
+#include "vbinary.h"
+
+namespace VCoin
+{
+    const size_t kDefaultMempoolBytes = 64 * 1024 * 1024;
+
+    enum class EvictionPolicy {
+        LowestPriority, // drop the transaction with the smallest sum first
+        Oldest          // drop the transaction with the oldest timestamp first
+    };
+
+    struct MempoolStats {
+        size_t count = 0;
+        size_t bytes = 0;
+        size_t peakBytes = 0;
+        uint64_t added = 0;
+        uint64_t duplicates = 0;
+        uint64_t evicted = 0;
+        uint64_t expired = 0;
+        uint64_t dropped = 0;   // unaffordable when a block template was built
+        uint64_t included = 0;  // removed because a block containing them was accepted
+    };
+
+    // Net changes to a pool since they were last taken: transactions that entered it and
+    // ids of those that left it.
+    struct MempoolChanges {
+        VTransactions added;
+        std::vector<std::string> removed;
+
+        bool empty() const {
+            return added.empty() && removed.empty();
+        }
+    };
+
+    // Transaction pool with a byte budget. Transactions are owned by a txid hash map and
+    // referenced from two ordered indexes (priority and age), so eviction, expiry and block
+    // template selection cost O(log n) per transaction and never copy the pool.
+    // Priority is the transaction sum, the only value signal a transaction carries.
+    // Not thread-safe; the miners share a template built from it instead of the pool.
+    class Mempool
+    {
+    private:
+        struct Entry {
+            VTransaction transaction;
+            size_t bytes;
+            uint64_t sequence;
+        };
+
+        // Index keys order ties by arrival so eviction is deterministic.
+        typedef std::pair<double, uint64_t> PriorityKey;
+        typedef std::pair<time_t, uint64_t> AgeKey;
+
+        std::unordered_map<std::string, Entry> entries;
+        std::map<PriorityKey, const std::string*> byPriority;
+        std::map<AgeKey, const std::string*> byAge;
+
+        size_t maxBytes;
+        EvictionPolicy policy;
+        time_t maxAge;
+        uint64_t nextSequence = 0;
+        MempoolStats _stats;
+
+        // With change tracking on, ids changed since takeChanges(): true if added, false if
+        // removed. Opposite changes cancel out.
+        bool tracking = false;
+        std::unordered_map<std::string, bool> pending;
+
+        void noteChange(const std::string& id, bool added) {
+            if (!tracking) return;
+            auto it = pending.find(id);
+            if (it != pending.end() && it->second != added) pending.erase(it);
+            else pending[id] = added;
+        }
+
+        // Approximate resident size: the entry, its heap-allocated strings and the nodes
+        // it occupies in the three indexes.
+        static size_t entryBytes(const VTransaction& transaction) {
+            const size_t kNodeOverhead = 3 * 4 * sizeof(void*);
+            return sizeof(Entry) + 2 * transaction.id.capacity() + transaction.sender().capacity()
+                   + transaction.receiver().capacity() + kNodeOverhead;
+        }
+
+        void erase(std::unordered_map<std::string, Entry>::iterator it) {
+            const Entry& entry = it->second;
+            noteChange(it->first, false);
+            byPriority.erase(PriorityKey(entry.transaction.sum(), entry.sequence));
+            byAge.erase(AgeKey(entry.transaction.timestamp(), entry.sequence));
+            _stats.bytes -= entry.bytes;
+            entries.erase(it);
+            _stats.count = entries.size();
+        }
+
+        void eraseId(const std::string& id) {
+            auto it = entries.find(id);
+            if (it != entries.end()) erase(it);
+        }
+
+        void evictToBudget() {
+            while (_stats.bytes > maxBytes && !entries.empty()) {
+                const std::string* victim = policy == EvictionPolicy::LowestPriority
+                        ? byPriority.begin()->second
+                        : byAge.begin()->second;
+                eraseId(*victim);
+                _stats.evicted++;
+            }
+        }
+
+    public:
+        explicit Mempool(size_t maxBytes = kDefaultMempoolBytes, EvictionPolicy policy = EvictionPolicy::LowestPriority, time_t maxAge = 0)
+                : maxBytes(maxBytes), policy(policy), maxAge(maxAge) {}
+
+        // Adds a validated transaction. Returns false if it was a duplicate or was itself
+        // evicted to stay within the byte budget.
+        bool add(VTransaction transaction) {
+            if (entries.count(transaction.id)) {
+                _stats.duplicates++;
+                return false;
+            }
+
+            size_t bytes = entryBytes(transaction);
+            uint64_t sequence = nextSequence++;
+            std::string id = transaction.id;
+            auto inserted = entries.emplace(id, Entry{std::move(transaction), bytes, sequence});
+            const Entry& entry = inserted.first->second;
+            const std::string* key = &inserted.first->first;
+            byPriority.emplace(PriorityKey(entry.transaction.sum(), sequence), key);
+            byAge.emplace(AgeKey(entry.transaction.timestamp(), sequence), key);
+            noteChange(id, true);
+
+            _stats.added++;
+            _stats.bytes += bytes;
+            _stats.count = entries.size();
+            evictToBudget();
+            _stats.peakBytes = std::max(_stats.peakBytes, _stats.bytes);
+            return entries.count(id) != 0;
+        }
+
+        // Drops transactions whose timestamp is more than maxAge seconds before now.
+        size_t expire(time_t now) {
+            if (maxAge <= 0) return 0;
+            size_t expired = 0;
+            while (!byAge.empty() && byAge.begin()->first.first < now - maxAge) {
+                eraseId(*byAge.begin()->second);
+                expired++;
+            }
+            _stats.expired += expired;
+            return expired;
+        }
+
+        // Fills the block with up to maxCount of the highest-priority transactions whose
+        // senders can afford them given the current balances. Unaffordable transactions
+        // are dropped from the pool; selected ones stay until the block is accepted.
+        void buildBlock(const VUsers& users, VBlock& block, size_t maxCount) {
+            std::unordered_map<std::string, double> balances;
+            auto balanceOf = [&](const std::string& key) -> double& {
+                auto it = balances.find(key);
+                if (it != balances.end()) return it->second;
+                auto user = users.find(key);
+                return balances[key] = user != users.end() ? user->second.balance : 0;
+            };
+
+            std::vector<const std::string*> unaffordable;
+            for (auto it = byPriority.rbegin(); it != byPriority.rend() && block.transactions.size() < maxCount; ++it) {
+                const VTransaction& transaction = entries.find(*it->second)->second.transaction;
+                double& senderBalance = balanceOf(transaction.sender());
+                if (senderBalance >= transaction.sum()) {
+                    senderBalance -= transaction.sum();
+                    balanceOf(transaction.receiver()) += transaction.sum();
+                    block.transactions.push_back(transaction);
+                }
+                else unaffordable.push_back(it->second);
+            }
+
+            for (auto id : unaffordable) {
+                eraseId(*id);
+            }
+            _stats.dropped += unaffordable.size();
+        }
+
+        // Removes the transactions of an accepted block.
+        void remove(const VTransactions& transactions) {
+            for (auto & transaction : transactions) {
+                auto it = entries.find(transaction.id);
+                if (it == entries.end()) continue;
+                erase(it);
+                _stats.included++;
+            }
+        }
+
+        // Follows the active chain: transactions of disconnected blocks return to the pool
+        // and those of newly connected blocks leave it.
+        void applyChainUpdate(const ChainUpdate& update) {
+            for (const auto & block : update.disconnected) {
+                for (const auto & transaction : block.block->transactions) {
+                    add(transaction);
+                }
+            }
+            for (const auto & block : update.connected) {
+                remove(block.block->transactions);
+            }
+        }
+
+        // Starts recording changes for takeChanges(), so the pool can be persisted
+        // incrementally.
+        void trackChanges() {
+            tracking = true;
+        }
+
+        MempoolChanges takeChanges() {
+            MempoolChanges changes;
+            for (const auto & change : pending) {
+                if (change.second) changes.added.push_back(entries.find(change.first)->second.transaction);
+                else changes.removed.push_back(change.first);
+            }
+            pending.clear();
+            return changes;
+        }
+
+        bool contains(const std::string& id) const {
+            return entries.count(id) != 0;
+        }
+
+        template <typename Callback>
+        void forEach(Callback callback) const {
+            for (auto & entry : entries) {
+                callback(entry.second.transaction);
+            }
+        }
+
+        size_t size() const {
+            return entries.size();
+        }
+
+        bool empty() const {
+            return entries.empty();
+        }
+
+        size_t bytes() const {
+            return _stats.bytes;
+        }
+
+        const MempoolStats& stats() const {
+            return _stats;
+        }
+    };
+}
+
+namespace VCoin { namespace IO
+    {
+        void writeTransactionsToFile(const std::string& fpath, const Mempool& mempool, bool append = false) {
+            std::ofstream out;
+            if (append) out.open(fpath, std::ofstream::app);
+            else out.open(fpath);
+            out << std::setprecision(std::numeric_limits<double>::max_digits10);
+
+            mempool.forEach([&out](const VTransaction& transaction) {
+                writeTransaction(out, transaction);
+            });
+            out.close();
+        }
+
+        void writeTransactionsToBinaryFile(const std::string& fpath, const Mempool& mempool) {
+            writeTransactionRecords(fpath, mempool.size(), [&mempool](const std::function<void(const VTransaction&)>& callback) {
+                mempool.forEach(callback);
+            });
+        }
+    } }
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include "vfile.h"
+
+namespace VCoin
+{
+    // One miner's share of a block round.
+    struct MinerMetrics {
+        std::string name;
+        uint64_t attempts = 0;
+        double seconds = 0;
+        bool found = false;         // it found a block, whether or not that block won
+
+        double hashrate() const {
+            return seconds > 0 ? attempts / seconds : 0;
+        }
+    };
+
+    // What it took to mine one active block. Times are in seconds; I/O is the persistence
+    // work done on the mining critical path (encoding records, queueing them and waiting
+    // for room in the queue), not the writer thread's.
+    struct BlockMetrics {
+        uint64_t height = 0;
+        std::string hash;
+        std::string winner;
+        size_t transactions = 0;
+        double templateSeconds = 0;
+        double merkleSeconds = 0;   // the winner's
+        double miningSeconds = 0;   // from the miners' start until the block was accepted
+        double ioSeconds = 0;
+        uint64_t attempts = 0;      // by all miners
+        uint64_t staleAttempts = 0; // by the miners that did not win
+        size_t staleBlocks = 0;     // found in the round but not on the active chain
+        std::vector<MinerMetrics> miners;
+    };
+
+    enum class MetricsFormat {
+        JsonLines,  // one JSON object per block
+        Csv         // one row per block, with attempts and hashrate columns per miner
+    };
+
+    // Appends BlockMetrics to a file for dashboards and comparing runs. The format follows
+    // the extension: .csv for CSV, anything else for JSON lines. A CSV header is written
+    // when the file is empty; appending to a CSV file from a run with a different number
+    // of miners gives rows of a different width.
+    class MetricsSink
+    {
+    private:
+        std::string path;
+        MetricsFormat format;
+        int fd = -1;
+        bool needHeader = false;
+
+        // Nine significant digits resolve nanoseconds in a one-second time.
+        static std::string number(double value) {
+            std::ostringstream out;
+            out << std::setprecision(9) << value;
+            return out.str();
+        }
+
+        static std::string jsonString(const std::string& value) {
+            std::string out = "\"";
+            for (char c : value) {
+                if (c == '"' || c == '\\') out += '\\';
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                }
+                else out += c;
+            }
+            return out + "\"";
+        }
+
+        static std::string json(const BlockMetrics& block) {
+            std::ostringstream out;
+            out << "{\"height\":" << block.height << ",\"hash\":" << jsonString(block.hash) << ",\"winner\":" << jsonString(block.winner)
+                << ",\"transactions\":" << block.transactions << ",\"template_seconds\":" << number(block.templateSeconds)
+                << ",\"merkle_seconds\":" << number(block.merkleSeconds) << ",\"mining_seconds\":" << number(block.miningSeconds)
+                << ",\"io_seconds\":" << number(block.ioSeconds) << ",\"attempts\":" << block.attempts
+                << ",\"stale_attempts\":" << block.staleAttempts << ",\"stale_blocks\":" << block.staleBlocks << ",\"miners\":[";
+            for (size_t i = 0; i < block.miners.size(); ++i) {
+                const MinerMetrics& miner = block.miners[i];
+                out << (i > 0 ? "," : "") << "{\"name\":" << jsonString(miner.name) << ",\"attempts\":" << miner.attempts
+                    << ",\"seconds\":" << number(miner.seconds) << ",\"hashrate\":" << number(miner.hashrate())
+                    << ",\"found\":" << (miner.found ? "true" : "false") << "}";
+            }
+            out << "]}\n";
+            return out.str();
+        }
+
+        static std::string csvHeader(const BlockMetrics& block) {
+            std::string header = "height,hash,winner,transactions,template_seconds,merkle_seconds,mining_seconds,io_seconds,attempts,stale_attempts,stale_blocks";
+            for (const auto & miner : block.miners) {
+                header += ",attempts_" + miner.name + ",hashrate_" + miner.name;
+            }
+            return header + "\n";
+        }
+
+        static std::string csv(const BlockMetrics& block) {
+            std::ostringstream out;
+            out << block.height << "," << block.hash << "," << block.winner << "," << block.transactions << ","
+                << number(block.templateSeconds) << "," << number(block.merkleSeconds) << "," << number(block.miningSeconds) << ","
+                << number(block.ioSeconds) << "," << block.attempts << "," << block.staleAttempts << "," << block.staleBlocks;
+            for (const auto & miner : block.miners) {
+                out << "," << miner.attempts << "," << number(miner.hashrate());
+            }
+            out << "\n";
+            return out.str();
+        }
+
+    public:
+        explicit MetricsSink(const std::string& fpath) : path(fpath) {
+            format = fpath.size() >= 4 && fpath.compare(fpath.size() - 4, 4, ".csv") == 0 ? MetricsFormat::Csv : MetricsFormat::JsonLines;
+            fd = ::open(fpath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd < 0) throw IO::fileError("Failed to open file", fpath);
+            needHeader = format == MetricsFormat::Csv && IO::fileSize(fd, fpath) == 0;
+        }
+
+        ~MetricsSink() {
+            if (fd >= 0) ::close(fd);
+        }
+
+        MetricsSink(const MetricsSink&) = delete;
+        MetricsSink& operator=(const MetricsSink&) = delete;
+
+        // Each record is appended with one write, so a crash leaves whole lines behind.
+        void record(const BlockMetrics& block) {
+            std::string line;
+            if (needHeader) line = csvHeader(block);
+            line += format == MetricsFormat::Csv ? csv(block) : json(block);
+            IO::writeAll(fd, line.data(), line.size(), path);
+            needHeader = false;
+        }
+    };
+}
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <exception>
+#include <vector>
+#include "vjournal.h"
+
+namespace VCoin
+{
+    enum class SyncPolicy {
+        Always,   // sync the journal after every batch
+        Periodic, // sync at most once per sync interval, and before tasks and flushes
+        Never     // leave journal writeback to the OS; compactions still sync their files
+    };
+
+    struct PersistenceStats {
+        uint64_t records = 0;       // journal records written
+        uint64_t tasks = 0;         // other jobs run, e.g. compactions and snapshots
+        uint64_t batches = 0;
+        uint64_t syncs = 0;
+        uint64_t bytes = 0;         // journal bytes written
+        size_t queued = 0;          // jobs submitted but not finished
+        size_t peakQueued = 0;
+        uint64_t stalls = 0;        // submissions that had to wait for room in the queue
+        double stalledSeconds = 0;
+        double maxLagSeconds = 0;   // longest time from submitting a record until it was written
+
+        double recordsPerBatch() const {
+            return batches > 0 ? 1.0 * records / batches : 0;
+        }
+    };
+
+    // Moves persistence off the mining critical path: journal records and other jobs are
+    // handed to a dedicated writer thread and run in submission order. The writer takes
+    // everything queued at once and appends consecutive records with a single write and,
+    // depending on the SyncPolicy, a single sync. At most maxQueued records and tasks wait;
+    // beyond that submitting blocks until the writer catches up (backpressure), which
+    // stats() counts. Posted jobs never wait and do not count.
+    // Observers registered with syncWith() are synced before the journal every time it is,
+    // so the blocks and indexes a record names are durable no later than the record.
+    // A failed job stops the writer; the error is rethrown to the next submitter or flush().
+    // The journal must not be used by other threads while the queue runs.
+    class PersistenceQueue
+    {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Job {
+            std::string record;          // a journal record, or empty for a task
+            std::string tipHash;
+            std::function<void()> task;
+            bool afterRecords = true;    // the records queued before the task are written first
+            Clock::time_point submitted;
+        };
+
+        StateJournal& journal;
+        size_t maxQueued;
+        SyncPolicy policy;
+        Clock::duration syncInterval;
+
+        mutable std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<Job> queue;
+        size_t bounded = 0;              // queued records and tasks, which the limit applies to
+        size_t inFlight = 0;             // jobs taken by the writer and not finished yet
+        bool stopping = false;
+        std::exception_ptr error;
+        PersistenceStats _stats;
+        std::vector<ChainObserver*> syncTargets;
+
+        // Writer thread state.
+        bool unsynced = false;
+        Clock::time_point lastSync;
+        std::thread writer;
+
+        // Observers first: a durable record must not name a tip the store cannot serve.
+        void syncJournal() {
+            std::vector<ChainObserver*> targets;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                targets = syncTargets;
+            }
+            for (auto target : targets) target->sync();
+            journal.sync();
+            unsynced = false;
+            lastSync = Clock::now();
+            std::lock_guard<std::mutex> lock(mutex);
+            _stats.syncs++;
+        }
+
+        bool syncDue() const {
+            return policy == SyncPolicy::Always || (policy == SyncPolicy::Periodic && Clock::now() - lastSync >= syncInterval);
+        }
+
+        void process(std::deque<Job>& batch) {
+            std::string pending;
+            size_t count = 0;
+            std::string tipHash;
+            Clock::time_point oldest;
+
+            auto writePending = [&](bool forceSync) {
+                if (count == 0) return;
+                journal.write(pending, count, tipHash, false);
+                unsynced = true;
+                if (forceSync || syncDue()) syncJournal();
+                double lag = std::chrono::duration<double>(Clock::now() - oldest).count();
+                std::lock_guard<std::mutex> lock(mutex);
+                _stats.records += count;
+                _stats.bytes += pending.size();
+                _stats.maxLagSeconds = std::max(_stats.maxLagSeconds, lag);
+                pending.clear();
+                count = 0;
+            };
+
+            for (auto & job : batch) {
+                if (job.task && !job.afterRecords) {
+                    job.task();
+                    unsynced = true;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    _stats.tasks++;
+                    continue;
+                }
+                if (job.task) {
+                    writePending(policy != SyncPolicy::Never);
+                    if (unsynced && policy != SyncPolicy::Never) syncJournal();
+                    job.task();
+                    std::lock_guard<std::mutex> lock(mutex);
+                    _stats.tasks++;
+                    continue;
+                }
+                if (count == 0) oldest = job.submitted;
+                pending += job.record;
+                tipHash = job.tipHash;
+                count++;
+            }
+            writePending(false);
+        }
+
+        void run() {
+            while (true) {
+                std::deque<Job> batch;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (unsynced && policy == SyncPolicy::Periodic) {
+                        changed.wait_until(lock, lastSync + syncInterval, [&]() { return !queue.empty() || stopping; });
+                    }
+                    else changed.wait(lock, [&]() { return !queue.empty() || stopping; });
+                    if (queue.empty() && stopping) break;
+                    batch.swap(queue);
+                    bounded = 0;
+                    inFlight = batch.size();
+                    if (!batch.empty()) _stats.batches++;
+                }
+                changed.notify_all();
+
+                try {
+                    if (!error) {
+                        process(batch);
+                        if (unsynced && syncDue()) syncJournal();
+                    }
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = std::current_exception();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    inFlight = 0;
+                }
+                changed.notify_all();
+            }
+            try {
+                if (unsynced && policy != SyncPolicy::Never && !error) syncJournal();
+            }
+            catch (const std::exception& e) {
+                std::cerr << e.what() << "\n";
+            }
+        }
+
+        void enqueue(Job job, bool waitForRoom = true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (waitForRoom && bounded >= maxQueued && !error) {
+                auto start = Clock::now();
+                _stats.stalls++;
+                changed.wait(lock, [&]() { return bounded < maxQueued || error; });
+                _stats.stalledSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+            }
+            if (error) std::rethrow_exception(error);
+            job.submitted = Clock::now();
+            if (waitForRoom) bounded++;
+            queue.push_back(std::move(job));
+            _stats.peakQueued = std::max(_stats.peakQueued, queue.size() + inFlight);
+            lock.unlock();
+            changed.notify_all();
+        }
+
+    public:
+        PersistenceQueue(StateJournal& journal, size_t maxQueued = 8, SyncPolicy policy = SyncPolicy::Always,
+                         std::chrono::milliseconds syncInterval = std::chrono::milliseconds(100))
+                : journal(journal), maxQueued(std::max<size_t>(maxQueued, 1)), policy(policy), syncInterval(syncInterval),
+                  lastSync(Clock::now()) {
+            writer = std::thread([this]() { run(); });
+        }
+
+        // Finishes the queued jobs; errors are dropped, call flush() first to see them.
+        ~PersistenceQueue() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            writer.join();
+        }
+
+        PersistenceQueue(const PersistenceQueue&) = delete;
+        PersistenceQueue& operator=(const PersistenceQueue&) = delete;
+
+        // Queues a record from StateJournal::record() that leaves the chain at tipHash.
+        void append(std::string record, const std::string& tipHash) {
+            if (record.empty()) return;
+            Job job;
+            job.record = std::move(record);
+            job.tipHash = tipHash;
+            enqueue(std::move(job));
+        }
+
+        // Queues a job to run on the writer thread after the records queued before it are
+        // written. It must own the data it needs.
+        void submit(std::function<void()> task) {
+            Job job;
+            job.task = std::move(task);
+            enqueue(std::move(job));
+        }
+
+        // Syncs observer before each journal sync from now on.
+        void syncWith(ChainObserver* observer) {
+            std::lock_guard<std::mutex> lock(mutex);
+            syncTargets.push_back(observer);
+        }
+
+        // Queues a job that does not depend on the journal, such as an index write. It runs
+        // after the jobs queued before it, except that journal records queued before it may
+        // be written after it, so it neither splits a batch of records nor forces a sync first.
+        // It never waits for room in the queue, since QueuedObserver posts from inside
+        // BlockChain::insert and waiting there would hold the chain lock on a slow disk;
+        // posts are still bounded by the records submitted with them, which do wait.
+        void post(std::function<void()> task) {
+            Job job;
+            job.task = std::move(task);
+            job.afterRecords = false;
+            enqueue(std::move(job), false);
+        }
+
+        // Waits until everything queued so far is written and, unless the policy is Never,
+        // synced. Rethrows the writer's error, if any.
+        void flush() {
+            submit([]() {});
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return (queue.empty() && inFlight == 0) || error; });
+            if (error) std::rethrow_exception(error);
+        }
+
+        PersistenceStats stats() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            PersistenceStats stats = _stats;
+            stats.queued = queue.size() + inFlight;
+            return stats;
+        }
+    };
+
+    // Runs a BlockChain's observer hooks on a PersistenceQueue's writer thread, so insert()
+    // only posts them, waiting neither for their file writes nor for room in the queue.
+    // Each hook is one job for all the targets, which see the hooks in the order the chain
+    // made them; targets are told through blockDeferred when a block is accepted, before
+    // its blockAccepted runs. Targets must be thread-safe, and only see hooks made after
+    // they are added; they are synced before the journal under the queue's SyncPolicy.
+    class QueuedObserver : public ChainObserver
+    {
+    private:
+        PersistenceQueue& queue;
+        std::vector<ChainObserver*> targets;
+
+    public:
+        explicit QueuedObserver(PersistenceQueue& queue) : queue(queue) {}
+
+        // Not thread-safe; add targets before the chain is used concurrently.
+        void add(ChainObserver* target) {
+            targets.push_back(target);
+            queue.syncWith(target);
+        }
+
+        void blockAccepted(const std::string& hash, const VBlockHandle& block) override {
+            for (auto target : targets) target->blockDeferred(hash, block);
+            std::vector<ChainObserver*> to(targets);
+            queue.post([to, hash, block]() {
+                for (auto target : to) target->blockAccepted(hash, block);
+            });
+        }
+
+        void activeChainChanged(size_t firstHeight, const ChainUpdate& update) override {
+            std::vector<ChainObserver*> to(targets);
+            queue.post([to, firstHeight, update]() {
+                for (auto target : to) target->activeChainChanged(firstHeight, update);
+            });
+        }
+
+        void blockPruned(size_t height, const std::string& hash) override {
+            std::vector<ChainObserver*> to(targets);
+            queue.post([to, height, hash]() {
+                for (auto target : to) target->blockPruned(height, hash);
+            });
+        }
+    };
+}
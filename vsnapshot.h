@@ -0,0 +1,168 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include "vcoin.h"
+#include "vfile.h"
+#include "vbinary.h"
+
+namespace VCoin
+{
+    // Read-only view of a ledger snapshot file: the account table as it was after the
+    // active block at height(), in key order. The file is a 64-byte header
+    // { magic, version, height, count, checksum, block digest[32] } followed by count
+    // user records in the binary data files' layout (IO::storeUserRecord). The checksum
+    // (FNV-1a over everything but itself) is verified when the file is opened.
+    class LedgerSnapshot
+    {
+    private:
+        static const uint32_t kMagic = 0x504e5356;   // "VSNP"
+        static const uint32_t kVersion = 1;
+        static const size_t kHeaderSize = 64;
+        static const size_t kRecordSize = IO::kUserRecordSize;
+
+        IO::MappedFile file;
+
+        static uint64_t checksum(const char* data, size_t size) {
+            uint64_t hash = IO::fnv1a(IO::kFnvOffsetBasis, data + 8, 16);
+            return IO::fnv1a(hash, data + 32, size - 32);
+        }
+
+    public:
+        // Throws std::runtime_error if the file is missing, truncated or corrupt.
+        explicit LedgerSnapshot(const std::string& fpath) : file(fpath) {
+            const char* data = file.data();
+            if (file.size() < kHeaderSize || IO::loadU32(data) != kMagic || IO::loadU32(data + 4) != kVersion) {
+                throw std::runtime_error("Unrecognized snapshot file " + fpath);
+            }
+            if (file.size() != kHeaderSize + size() * kRecordSize) throw std::runtime_error("Truncated snapshot file " + fpath);
+            if (IO::loadU64(data + 24) != checksum(data, file.size())) throw std::runtime_error("Corrupt snapshot file " + fpath);
+        }
+
+        uint64_t height() const {
+            return IO::loadU64(file.data() + 8);
+        }
+
+        size_t size() const {
+            return static_cast<size_t>(IO::loadU64(file.data() + 16));
+        }
+
+        std::string blockHash() const {
+            bc::hash_digest digest;
+            std::memcpy(digest.data(), file.data() + 32, digest.size());
+            return bc::encode_base16(digest);
+        }
+
+        VUser user(size_t i) const {
+            return IO::loadUserRecord(file.data() + kHeaderSize + i * kRecordSize);
+        }
+
+        VUsers toUsers() const {
+            VUsers users;
+            for (size_t i = 0; i < size(); ++i) {
+                VUser entry = user(i);
+                users.emplace_hint(users.end(), entry.key, entry);
+            }
+            return users;
+        }
+
+        static void write(const std::string& fpath, const VUsers& users, uint64_t height, const std::string& blockHash) {
+            bc::hash_digest digest;
+            if (!decodeHash(blockHash, digest)) throw std::invalid_argument("Not a block hash: " + blockHash);
+
+            std::string contents(kHeaderSize + users.size() * kRecordSize, '\0');
+            char* data = &contents[0];
+            IO::storeU32(data, kMagic);
+            IO::storeU32(data + 4, kVersion);
+            IO::storeU64(data + 8, height);
+            IO::storeU64(data + 16, users.size());
+            std::memcpy(data + 32, digest.data(), digest.size());
+
+            char* record = data + kHeaderSize;
+            for (const auto & user : users) {
+                IO::storeUserRecord(record, user.second);
+                record += kRecordSize;
+            }
+            IO::storeU64(data + 24, checksum(data, contents.size()));
+            IO::writeFileAtomically(fpath, contents);
+        }
+    };
+
+    // Keeps periodic ledger snapshots (ledger-<height>.snap) in a directory so a restart
+    // only has to replay the blocks after the newest one instead of the whole chain. The
+    // genesis snapshot and the newest keep snapshots are retained; older ones are deleted.
+    class SnapshotManager
+    {
+    private:
+        std::string directory;
+        size_t keep;
+
+        std::string pathOf(uint64_t height) const {
+            return directory + "/ledger-" + std::to_string(height) + ".snap";
+        }
+
+    public:
+        explicit SnapshotManager(const std::string& directory, size_t keep = 2) : directory(directory), keep(std::max<size_t>(keep, 1)) {
+            IO::makeDirectory(directory);
+        }
+
+        // Heights of the snapshots on disk, ascending.
+        std::vector<uint64_t> heights() const {
+            std::vector<uint64_t> result;
+            const std::string prefix = "ledger-", suffix = ".snap";
+            for (const auto & name : IO::listDirectory(directory)) {
+                if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0 ||
+                    name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) continue;
+                std::string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+                if (digits.find_first_not_of("0123456789") != std::string::npos) continue;
+                result.push_back(std::strtoull(digits.c_str(), nullptr, 10));
+            }
+            std::sort(result.begin(), result.end());
+            return result;
+        }
+
+        void save(const VUsers& users, uint64_t height, const std::string& blockHash) {
+            LedgerSnapshot::write(pathOf(height), users, height, blockHash);
+            std::vector<uint64_t> existing = heights();
+            for (size_t i = 0; i + keep < existing.size(); ++i) {
+                if (existing[i] != 0) std::remove(pathOf(existing[i]).c_str());
+            }
+        }
+
+        void clear() {
+            for (uint64_t height : heights()) {
+                std::remove(pathOf(height).c_str());
+            }
+        }
+
+        // Loads the snapshot taken at height if it exists, is intact and was taken on the
+        // given active chain rather than on a branch that has since been reorganized away.
+        bool load(const ChainSnapshot& chain, uint64_t height, VUsers& users) const {
+            if (height >= chain.size()) return false;
+            try {
+                LedgerSnapshot snapshot(pathOf(height));
+                if (snapshot.height() != height || snapshot.blockHash() != chain.hashAt(height)) return false;
+                users = snapshot.toUsers();
+                return true;
+            }
+            catch (const std::runtime_error& e) {
+                std::cerr << e.what() << "\n";
+                return false;
+            }
+        }
+
+        // Loads the newest usable snapshot. Returns false if there is none.
+        bool loadLatest(const ChainSnapshot& chain, VUsers& users, uint64_t& height) const {
+            std::vector<uint64_t> existing = heights();
+            for (auto it = existing.rbegin(); it != existing.rend(); ++it) {
+                if (load(chain, *it, users)) {
+                    height = *it;
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+}
@@ -0,0 +1,494 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdio>
+#include "vcoin.h"
+#include "vfile.h"
+
+namespace VCoin
+{
+    const size_t kDefaultBlockFileBytes = 128 * 1024 * 1024;
+
+    // Where a block body lives: block file number, payload offset and payload length. A
+    // pruned block's location points at its header in headers.dat instead.
+    struct BlockLocation {
+        static const uint32_t kPrunedFile = 0xffffffff;
+
+        uint32_t file = 0;
+        uint32_t length = 0;
+        uint64_t offset = 0;
+
+        bool pruned() const {
+            return file == kPrunedFile;
+        }
+    };
+
+    // Zero-copy view of a stored block body inside a mapped block file. It keeps the
+    // mapping alive, so it stays valid even if the block is pruned in the meantime.
+    struct BlockView {
+        std::shared_ptr<const IO::MappedFile> file;
+        const char* data = nullptr;
+        size_t size = 0;
+
+        VBlock decode() const {
+            Serial::Reader in(data, size);
+            return VBlock::deserialize(in);
+        }
+
+        // Reads only the leading header, leaving the transactions untouched.
+        VBlockHeader decodeHeader() const {
+            Serial::Reader in(data, size);
+            VBlockHeader header;
+            header.deserializeHeader(in);
+            return header;
+        }
+    };
+
+    // Append-only on-disk block storage. Block bodies are appended as records to segmented
+    // block files (blkNNNNN.dat) and located through two memory-mapped indexes:
+    // heights.idx, an array of the active chain's blocks by height, and hashes.idx, an
+    // open-addressing hash table over every stored block. The store follows a BlockChain as
+    // one of its observers, so side branches are kept and reorgs rewrite only the affected
+    // heights. It is also the BlockSource a restored chain reads bodies from. Thread-safe.
+    //
+    // Pruned blocks keep only their header, appended to headers.dat, and a block file is
+    // deleted once every block in it has been pruned. When its hooks run on a writer thread,
+    // deferred blocks are served from memory until they are appended.
+    class BlockStore : public ChainObserver, public BlockSource
+    {
+    private:
+        static const uint32_t kRecordMagic = 0x4b4c4256;   // "VBLK"
+        static const uint32_t kHeightsMagic = 0x54474856;  // "VHGT"
+        static const uint32_t kHashesMagic = 0x48534856;   // "VHSH"
+        static const uint32_t kHeaderMagic = 0x52444856;   // "VHDR"
+        static const uint32_t kIndexVersion = 1;
+        static const size_t kRecordHeaderSize = 8;         // magic, payload length
+        static const size_t kIndexHeaderSize = 24;         // magic, version, capacity, count
+        static const size_t kEntrySize = 48;               // digest, file, length, offset
+        static const uint64_t kInitialCapacity = 1024;
+
+        std::string directory;
+        size_t maxFileBytes;
+
+        // Appends go through a plain descriptor; reads through mappings that reserve
+        // maxFileBytes of address space, so they never move while the file grows.
+        int appendFd = -1;
+        uint32_t appendFile = 0;
+        uint64_t appendOffset = 0;
+        std::string record;
+        mutable std::vector<std::shared_ptr<const IO::MappedFile>> blockFiles;
+        std::vector<uint64_t> liveRecords; // unpruned blocks per block file
+
+        // Headers of pruned blocks, read with pread since they are small and rarely needed.
+        int headersFd = -1;
+        uint64_t headersOffset = 0;
+
+        IO::MappedFile heights;
+        IO::MappedFile hashes;
+        std::unordered_map<std::string, VBlockHandle> deferred;
+        mutable std::mutex mutex;
+
+        std::string blockFilePath(uint32_t file) const {
+            char name[32];
+            std::snprintf(name, sizeof(name), "blk%05u.dat", file);
+            return directory + "/" + name;
+        }
+
+        static bc::hash_digest digestOf(const std::string& hash) {
+            bc::hash_digest digest;
+            if (!decodeHash(hash, digest)) throw std::invalid_argument("Not a block hash: " + hash);
+            return digest;
+        }
+
+        // Index files share one layout: a header followed by capacity entries of
+        // { digest[32], file u32, length u32, offset u64 }. An entry with length 0 is empty.
+        static void openIndex(IO::MappedFile& index, const std::string& fpath, uint32_t magic) {
+            index.open(fpath, true);
+            if (index.size() == 0) {
+                index.resize(kIndexHeaderSize + kInitialCapacity * kEntrySize);
+                IO::storeU32(index.data(), magic);
+                IO::storeU32(index.data() + 4, kIndexVersion);
+                IO::storeU64(index.data() + 8, kInitialCapacity);
+                IO::storeU64(index.data() + 16, 0);
+            }
+            if (IO::loadU32(index.data()) != magic || IO::loadU32(index.data() + 4) != kIndexVersion) {
+                throw std::runtime_error("Unrecognized index file " + fpath);
+            }
+        }
+
+        static uint64_t capacityOf(const IO::MappedFile& index) { return IO::loadU64(index.data() + 8); }
+        static uint64_t countOf(const IO::MappedFile& index) { return IO::loadU64(index.data() + 16); }
+        static void setCount(IO::MappedFile& index, uint64_t count) { IO::storeU64(index.data() + 16, count); }
+
+        static char* entryAt(IO::MappedFile& index, uint64_t slot) {
+            return index.data() + kIndexHeaderSize + slot * kEntrySize;
+        }
+
+        static const char* entryAt(const IO::MappedFile& index, uint64_t slot) {
+            return index.data() + kIndexHeaderSize + slot * kEntrySize;
+        }
+
+        static void writeEntry(char* entry, const bc::hash_digest& digest, const BlockLocation& location) {
+            std::memcpy(entry, digest.data(), digest.size());
+            IO::storeU32(entry + 32, location.file);
+            IO::storeU32(entry + 36, location.length);
+            IO::storeU64(entry + 40, location.offset);
+        }
+
+        static BlockLocation readEntry(const char* entry) {
+            BlockLocation location;
+            location.file = IO::loadU32(entry + 32);
+            location.length = IO::loadU32(entry + 36);
+            location.offset = IO::loadU64(entry + 40);
+            return location;
+        }
+
+        // Linear probing; returns the matching slot or the empty slot where it would go.
+        static uint64_t probe(const IO::MappedFile& index, const bc::hash_digest& digest) {
+            const uint64_t mask = capacityOf(index) - 1;
+            uint64_t slot = IO::loadU64(reinterpret_cast<const char*>(digest.data())) & mask;
+            while (true) {
+                const char* entry = entryAt(index, slot);
+                if (IO::loadU32(entry + 36) == 0) return slot;
+                if (std::memcmp(entry, digest.data(), digest.size()) == 0) return slot;
+                slot = (slot + 1) & mask;
+            }
+        }
+
+        // Doubles the hash table into a new file that atomically replaces the old one.
+        void growHashes() {
+            const std::string fpath = directory + "/hashes.idx";
+            const std::string tmpPath = fpath + ".tmp";
+            std::remove(tmpPath.c_str());
+            const uint64_t capacity = capacityOf(hashes) * 2;
+            {
+                IO::MappedFile grown(tmpPath, true);
+                grown.resize(kIndexHeaderSize + capacity * kEntrySize);
+                std::memcpy(grown.data(), hashes.data(), kIndexHeaderSize);
+                IO::storeU64(grown.data() + 8, capacity);
+                for (uint64_t slot = 0; slot < capacityOf(hashes); ++slot) {
+                    const char* entry = entryAt(hashes, slot);
+                    if (IO::loadU32(entry + 36) == 0) continue;
+                    bc::hash_digest digest;
+                    std::memcpy(digest.data(), entry, digest.size());
+                    std::memcpy(entryAt(grown, probe(grown, digest)), entry, kEntrySize);
+                }
+                grown.sync();
+            }
+            if (std::rename(tmpPath.c_str(), fpath.c_str()) != 0) throw IO::fileError("Failed to replace index", fpath);
+            openIndex(hashes, fpath, kHashesMagic);
+        }
+
+        bool findLocked(const bc::hash_digest& digest, BlockLocation& location) const {
+            const char* entry = entryAt(hashes, probe(hashes, digest));
+            if (IO::loadU32(entry + 36) == 0) return false;
+            location = readEntry(entry);
+            return true;
+        }
+
+        void setHeightLocked(size_t height, const bc::hash_digest& digest, const BlockLocation& location) {
+            const uint64_t count = countOf(heights);
+            if (height > count) throw std::out_of_range("Height " + std::to_string(height) + " leaves a gap in the block index");
+            if (height >= capacityOf(heights)) {
+                const uint64_t capacity = capacityOf(heights) * 2;
+                heights.resize(kIndexHeaderSize + capacity * kEntrySize);
+                IO::storeU64(heights.data() + 8, capacity);
+            }
+            writeEntry(entryAt(heights, height), digest, location);
+            if (height == count) setCount(heights, count + 1);
+        }
+
+        // A full block file is synced before it is closed, since sync() only sees the
+        // current one.
+        void openAppendFile(uint32_t file) {
+            if (appendFd >= 0) {
+                if (fsync(appendFd) != 0) throw IO::fileError("Failed to sync block file", blockFilePath(appendFile));
+                ::close(appendFd);
+            }
+            const std::string fpath = blockFilePath(file);
+            appendFd = ::open(fpath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (appendFd < 0) throw IO::fileError("Failed to open block file", fpath);
+            appendFile = file;
+            appendOffset = IO::fileSize(appendFd, fpath);
+        }
+
+        const std::shared_ptr<const IO::MappedFile>& blockFile(uint32_t file) const {
+            if (blockFiles.size() <= file) blockFiles.resize(file + 1);
+            if (!blockFiles[file]) {
+                blockFiles[file] = std::make_shared<const IO::MappedFile>(blockFilePath(file), false, maxFileBytes);
+            }
+            return blockFiles[file];
+        }
+
+        void countRecord(uint32_t file) {
+            if (liveRecords.size() <= file) liveRecords.resize(file + 1, 0);
+            liveRecords[file]++;
+        }
+
+        // Rebuilds the per-file record counts; returns the highest block file in use.
+        uint32_t scanLiveRecords() {
+            uint32_t last = 0;
+            for (uint64_t slot = 0; slot < capacityOf(hashes); ++slot) {
+                const char* entry = entryAt(hashes, slot);
+                if (IO::loadU32(entry + 36) == 0) continue;
+                BlockLocation location = readEntry(entry);
+                if (location.pruned()) continue;
+                countRecord(location.file);
+                last = std::max(last, location.file);
+            }
+            return last;
+        }
+
+    public:
+        explicit BlockStore(const std::string& directory, size_t maxFileBytes = kDefaultBlockFileBytes)
+                : directory(directory), maxFileBytes(maxFileBytes) {
+            IO::makeDirectory(directory);
+            openIndex(heights, directory + "/heights.idx", kHeightsMagic);
+            openIndex(hashes, directory + "/hashes.idx", kHashesMagic);
+
+            const std::string headersPath = directory + "/headers.dat";
+            headersFd = ::open(headersPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if (headersFd < 0) throw IO::fileError("Failed to open header file", headersPath);
+            headersOffset = IO::fileSize(headersFd, headersPath);
+
+            // Early block files may have been deleted by pruning, so start from the last
+            // indexed one and pick up any later file holding only unindexed appends.
+            uint32_t last = scanLiveRecords();
+            while (access(blockFilePath(last + 1).c_str(), F_OK) == 0) last++;
+            openAppendFile(last);
+        }
+
+        ~BlockStore() {
+            if (appendFd >= 0) ::close(appendFd);
+            if (headersFd >= 0) ::close(headersFd);
+        }
+
+        BlockStore(const BlockStore&) = delete;
+        BlockStore& operator=(const BlockStore&) = delete;
+
+        // Appends the block body unless the hash is already stored; returns its location.
+        BlockLocation append(const std::string& hash, const VBlock& block) {
+            bc::hash_digest digest = digestOf(hash);
+            std::lock_guard<std::mutex> lock(mutex);
+            BlockLocation location;
+            deferred.erase(hash);
+            if (findLocked(digest, location)) return location;
+
+            const size_t payloadSize = block.serializedSize();
+            record.clear();
+            record.reserve(kRecordHeaderSize + payloadSize);
+            Serial::putU32(record, kRecordMagic);
+            Serial::putU32(record, static_cast<uint32_t>(payloadSize));
+            block.serialize(record);
+
+            if (appendOffset > 0 && appendOffset + record.size() > maxFileBytes) {
+                const uint32_t previous = appendFile;
+                openAppendFile(appendFile + 1);
+                if (previous < liveRecords.size() && liveRecords[previous] == 0) {
+                    if (previous < blockFiles.size()) blockFiles[previous].reset();
+                    std::remove(blockFilePath(previous).c_str());
+                }
+            }
+            IO::writeAll(appendFd, record.data(), record.size(), blockFilePath(appendFile));
+
+            location.file = appendFile;
+            location.offset = appendOffset + kRecordHeaderSize;
+            location.length = static_cast<uint32_t>(payloadSize);
+            appendOffset += record.size();
+            countRecord(appendFile);
+
+            if ((countOf(hashes) + 1) * 2 > capacityOf(hashes)) growHashes();
+            writeEntry(entryAt(hashes, probe(hashes, digest)), digest, location);
+            setCount(hashes, countOf(hashes) + 1);
+            return location;
+        }
+
+        // Points an active-chain height at a stored block. Heights are filled in order.
+        void setHeight(size_t height, const std::string& hash) {
+            bc::hash_digest digest = digestOf(hash);
+            std::lock_guard<std::mutex> lock(mutex);
+            BlockLocation location;
+            if (!findLocked(digest, location)) throw std::out_of_range("Block " + hash + " is not stored");
+            setHeightLocked(height, digest, location);
+        }
+
+        // Forgets active-chain heights >= size; the bodies stay reachable by hash.
+        void truncate(size_t size) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (size < countOf(heights)) setCount(heights, size);
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return countOf(heights);
+        }
+
+        bool empty() const {
+            return size() == 0;
+        }
+
+        bool find(const std::string& hash, BlockLocation& location) const {
+            bc::hash_digest digest = digestOf(hash);
+            std::lock_guard<std::mutex> lock(mutex);
+            return findLocked(digest, location);
+        }
+
+        bool contains(const std::string& hash) const {
+            BlockLocation location;
+            return find(hash, location);
+        }
+
+        bool locate(size_t height, BlockLocation& location) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (height >= countOf(heights)) return false;
+            location = readEntry(entryAt(heights, height));
+            return true;
+        }
+
+        std::string hashAt(size_t height) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (height >= countOf(heights)) throw std::out_of_range("Height " + std::to_string(height) + " is not stored");
+            bc::hash_digest digest;
+            std::memcpy(digest.data(), entryAt(heights, height), digest.size());
+            return bc::encode_base16(digest);
+        }
+
+        // Throws std::out_of_range for pruned locations, which have no body.
+        BlockView view(const BlockLocation& location) const {
+            if (location.pruned()) throw std::out_of_range("Block body has been pruned");
+            std::lock_guard<std::mutex> lock(mutex);
+            BlockView view;
+            view.file = blockFile(location.file);
+            view.data = view.file->data() + location.offset;
+            view.size = location.length;
+            return view;
+        }
+
+        // Works for pruned blocks too.
+        VBlockHeader loadHeader(const BlockLocation& location) const {
+            if (!location.pruned()) return view(location).decodeHeader();
+            std::string payload(location.length, '\0');
+            ssize_t read = pread(headersFd, &payload[0], payload.size(), static_cast<off_t>(location.offset));
+            if (read != static_cast<ssize_t>(payload.size())) throw IO::fileError("Failed to read header file", directory + "/headers.dat");
+            Serial::Reader in(payload.data(), payload.size());
+            VBlockHeader header;
+            header.deserializeHeader(in);
+            return header;
+        }
+
+        // Throws BlockPrunedError for pruned blocks.
+        VBlockHandle load(const std::string& hash) const override {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = deferred.find(hash);
+                if (it != deferred.end()) return it->second;
+            }
+            BlockLocation location;
+            if (!find(hash, location)) throw std::out_of_range("Block " + hash + " is not stored");
+            if (location.pruned()) throw BlockPrunedError(hash);
+            return std::make_shared<const VBlock>(view(location).decode());
+        }
+
+        VBlockHandle loadAt(size_t height) const {
+            BlockLocation location;
+            if (!locate(height, location)) throw std::out_of_range("Height " + std::to_string(height) + " is not stored");
+            if (location.pruned()) throw BlockPrunedError(hashAt(height));
+            return std::make_shared<const VBlock>(view(location).decode());
+        }
+
+        // Replaces a block's body by its header, repointing the height index too if the
+        // block is active at height. The block file goes once none of its blocks are left;
+        // views into it keep their mapping until they are dropped. Idempotent.
+        void prune(size_t height, const std::string& hash) {
+            bc::hash_digest digest = digestOf(hash);
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t slot = probe(hashes, digest);
+            char* entry = entryAt(hashes, slot);
+            if (IO::loadU32(entry + 36) == 0) return;
+            const BlockLocation body = readEntry(entry);
+            if (body.pruned()) return;
+
+            const IO::MappedFile& file = *blockFile(body.file);
+            Serial::Reader in(file.data() + body.offset, body.length);
+            VBlockHeader header;
+            header.deserializeHeader(in);
+            const size_t headerSize = header.serializedHeaderSize();
+
+            record.clear();
+            Serial::putU32(record, kHeaderMagic);
+            Serial::putU32(record, static_cast<uint32_t>(headerSize));
+            record.append(file.data() + body.offset, headerSize);
+            IO::writeAll(headersFd, record.data(), record.size(), directory + "/headers.dat");
+
+            BlockLocation location;
+            location.file = BlockLocation::kPrunedFile;
+            location.offset = headersOffset + kRecordHeaderSize;
+            location.length = static_cast<uint32_t>(headerSize);
+            headersOffset += record.size();
+            writeEntry(entry, digest, location);
+            if (height < countOf(heights) && std::memcmp(entryAt(heights, height), digest.data(), digest.size()) == 0) {
+                writeEntry(entryAt(heights, height), digest, location);
+            }
+
+            if (--liveRecords[body.file] == 0 && body.file != appendFile) {
+                blockFiles[body.file].reset();
+                std::remove(blockFilePath(body.file).c_str());
+            }
+        }
+
+        // Headers of the active chain, genesis first, for restoring a BlockChain. Only the
+        // header part of each record is decoded.
+        std::vector<ChainHeader> loadActiveHeaders() const {
+            std::vector<ChainHeader> chain(size());
+            for (size_t height = 0; height < chain.size(); ++height) {
+                BlockLocation location;
+                locate(height, location);
+                chain[height].hash = hashAt(height);
+                chain[height].header = std::make_shared<const VBlockHeader>(loadHeader(location));
+            }
+            return chain;
+        }
+
+        // One above the highest active height whose body was pruned, or 0 if none was: the
+        // pruned height to restore a chain with.
+        size_t prunedHeight() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (uint64_t height = countOf(heights); height > 0; --height) {
+                if (readEntry(entryAt(heights, height - 1)).pruned()) return height;
+            }
+            return 0;
+        }
+
+        // Flushes block files and indexes to stable storage.
+        void sync() override {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (fsync(appendFd) != 0) throw IO::fileError("Failed to sync block file", blockFilePath(appendFile));
+            if (fsync(headersFd) != 0) throw IO::fileError("Failed to sync header file", directory + "/headers.dat");
+            heights.sync();
+            hashes.sync();
+        }
+
+        void blockAccepted(const std::string& hash, const VBlockHandle& block) override {
+            append(hash, *block);
+        }
+
+        void blockDeferred(const std::string& hash, const VBlockHandle& block) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            deferred[hash] = block;
+        }
+
+        void activeChainChanged(size_t firstHeight, const ChainUpdate& update) override {
+            truncate(firstHeight);
+            for (size_t i = 0; i < update.connected.size(); ++i) {
+                setHeight(firstHeight + i, update.connected[i].hash);
+            }
+        }
+
+        void blockPruned(size_t height, const std::string& hash) override {
+            prune(height, hash);
+        }
+    };
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include "vcoin.h"
+#include "vfile.h"
+
+namespace VCoin
+{
+    // Where an active transaction lives: its block height and index in the block.
+    struct TxLocation {
+        uint64_t height;
+        uint32_t position;
+    };
+
+    // Persistent txid -> TxLocation index over the active chain: a memory-mapped
+    // open-addressing hash table (txindex.idx) with O(1) lookups. It follows a BlockChain
+    // as one of its observers, so reorgs drop the disconnected blocks' transactions and
+    // add the connected ones. catchUp() indexes blocks the index has not seen, e.g. an
+    // existing chain or the blocks inserted while it was detached, in parallel. The file
+    // records the active block it is current to, so a restart resumes from there.
+    // Transactions of pruned blocks stay indexed, but only unpruned ones can be added.
+    // Thread-safe.
+    class TxIndex : public ChainObserver
+    {
+    private:
+        static const uint32_t kMagic = 0x49585456;   // "VTXI"
+        static const uint32_t kVersion = 1;
+        static const size_t kHeaderSize = 64;        // magic, version, capacity, count, indexed, tip digest
+        static const size_t kEntrySize = 48;         // digest, height, position, used
+        static const uint64_t kInitialCapacity = 1024;
+        static const size_t kBuildBatch = 1024;      // blocks collected per parallel pass
+
+        struct Entry {
+            bc::hash_digest digest;
+            TxLocation location;
+        };
+
+        IO::MappedFile table;
+        mutable std::mutex mutex;
+
+        uint64_t capacity() const { return IO::loadU64(table.data() + 8); }
+        uint64_t count() const { return IO::loadU64(table.data() + 16); }
+        void setCount(uint64_t count) { IO::storeU64(table.data() + 16, count); }
+        uint64_t indexedLocked() const { return IO::loadU64(table.data() + 24); }
+
+        char* entryAt(uint64_t slot) { return table.data() + kHeaderSize + slot * kEntrySize; }
+        const char* entryAt(uint64_t slot) const { return table.data() + kHeaderSize + slot * kEntrySize; }
+        static bool used(const char* entry) { return IO::loadU32(entry + 44) != 0; }
+
+        static uint64_t home(const bc::hash_digest& digest, uint64_t capacity) {
+            return IO::loadU64(reinterpret_cast<const char*>(digest.data())) & (capacity - 1);
+        }
+
+        // Linear probing; returns the matching slot or the empty slot where it would go.
+        uint64_t probe(const bc::hash_digest& digest) const {
+            const uint64_t mask = capacity() - 1;
+            uint64_t slot = home(digest, capacity());
+            while (true) {
+                const char* entry = entryAt(slot);
+                if (!used(entry) || std::memcmp(entry, digest.data(), digest.size()) == 0) return slot;
+                slot = (slot + 1) & mask;
+            }
+        }
+
+        void initialize(uint64_t capacity) {
+            table.resize(0);
+            table.resize(kHeaderSize + capacity * kEntrySize);
+            IO::storeU32(table.data(), kMagic);
+            IO::storeU32(table.data() + 4, kVersion);
+            IO::storeU64(table.data() + 8, capacity);
+        }
+
+        void setTip(uint64_t indexed, const std::string& hash) {
+            IO::storeU64(table.data() + 24, indexed);
+            bc::hash_digest digest = bc::null_hash;
+            if (indexed > 0 && !decodeHash(hash, digest)) throw std::invalid_argument("Not a block hash: " + hash);
+            std::memcpy(table.data() + 32, digest.data(), digest.size());
+        }
+
+        std::string tipLocked() const {
+            bc::hash_digest digest;
+            std::memcpy(digest.data(), table.data() + 32, digest.size());
+            return bc::encode_base16(digest);
+        }
+
+        // Rehashes in place into a table of twice the size.
+        void grow() {
+            std::vector<Entry> entries;
+            entries.reserve(count());
+            for (uint64_t slot = 0; slot < capacity(); ++slot) {
+                const char* entry = entryAt(slot);
+                if (!used(entry)) continue;
+                Entry copy;
+                std::memcpy(copy.digest.data(), entry, copy.digest.size());
+                copy.location.height = IO::loadU64(entry + 32);
+                copy.location.position = IO::loadU32(entry + 40);
+                entries.push_back(copy);
+            }
+            const uint64_t indexed = indexedLocked();
+            const std::string tip = tipLocked();
+            initialize(capacity() * 2);
+            setTip(indexed, tip);
+            for (const auto & entry : entries) {
+                insertLocked(entry.digest, entry.location);
+            }
+        }
+
+        void reserveLocked(uint64_t additional) {
+            while ((count() + additional) * 2 > capacity()) grow();
+        }
+
+        void insertLocked(const bc::hash_digest& digest, const TxLocation& location) {
+            char* entry = entryAt(probe(digest));
+            if (!used(entry)) setCount(count() + 1);
+            std::memcpy(entry, digest.data(), digest.size());
+            IO::storeU64(entry + 32, location.height);
+            IO::storeU32(entry + 40, location.position);
+            IO::storeU32(entry + 44, 1);
+        }
+
+        // Backward-shift deletion keeps probe sequences intact without tombstones.
+        void eraseLocked(const bc::hash_digest& digest, uint64_t height) {
+            const uint64_t mask = capacity() - 1;
+            uint64_t hole = probe(digest);
+            char* entry = entryAt(hole);
+            if (!used(entry) || IO::loadU64(entry + 32) != height) return;
+            std::memset(entry, 0, kEntrySize);
+            setCount(count() - 1);
+
+            for (uint64_t slot = (hole + 1) & mask; used(entryAt(slot)); slot = (slot + 1) & mask) {
+                bc::hash_digest moved;
+                std::memcpy(moved.data(), entryAt(slot), moved.size());
+                const uint64_t want = home(moved, capacity());
+                // Move the entry into the hole unless its home lies cyclically in (hole, slot].
+                if (((slot - want) & mask) >= ((slot - hole) & mask)) {
+                    std::memcpy(entryAt(hole), entryAt(slot), kEntrySize);
+                    std::memset(entryAt(slot), 0, kEntrySize);
+                    hole = slot;
+                }
+            }
+        }
+
+        void addBlockLocked(uint64_t height, const VBlock& block) {
+            reserveLocked(block.transactions.size());
+            for (size_t i = 0; i < block.transactions.size(); ++i) {
+                insertLocked(block.transactions[i].hash(), TxLocation{height, static_cast<uint32_t>(i)});
+            }
+        }
+
+    public:
+        explicit TxIndex(const std::string& fpath) {
+            table.open(fpath, true);
+            if (table.size() == 0) initialize(kInitialCapacity);
+            if (table.size() < kHeaderSize || IO::loadU32(table.data()) != kMagic || IO::loadU32(table.data() + 4) != kVersion) {
+                throw std::runtime_error("Unrecognized transaction index " + fpath);
+            }
+        }
+
+        TxIndex(const TxIndex&) = delete;
+        TxIndex& operator=(const TxIndex&) = delete;
+
+        // Accepts a txid in hex; unknown or malformed ids are simply not found.
+        bool find(const std::string& txid, TxLocation& location) const {
+            bc::hash_digest digest;
+            if (!decodeHash(txid, digest)) return false;
+            return find(digest, location);
+        }
+
+        bool find(const bc::hash_digest& digest, TxLocation& location) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            const char* entry = entryAt(probe(digest));
+            if (!used(entry)) return false;
+            location.height = IO::loadU64(entry + 32);
+            location.position = IO::loadU32(entry + 40);
+            return true;
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return count();
+        }
+
+        // Number of active blocks the index is current to.
+        size_t indexedHeight() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return indexedLocked();
+        }
+
+        // Indexes the chain's blocks the index has not seen yet. If the chain no longer
+        // contains the block the index was current to, it is rebuilt from scratch. Blocks
+        // are loaded and hashed in parallel batches, then inserted. Must not run while the
+        // chain notifies this index of inserts. Returns the number of blocks indexed.
+        size_t catchUp(const ChainSnapshot& chain) {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t from = indexedLocked();
+            if (from > chain.size() || (from > 0 && chain.hashAt(from - 1) != tipLocked())) {
+                initialize(kInitialCapacity);
+                from = 0;
+            }
+            from = std::max<uint64_t>(from, chain.prunedHeight());
+
+            size_t indexed = 0;
+            for (uint64_t first = from; first < chain.size(); first += kBuildBatch) {
+                const size_t blocks = static_cast<size_t>(std::min<uint64_t>(kBuildBatch, chain.size() - first));
+                std::vector<VBlockHandle> loaded(blocks);
+                const long count = static_cast<long>(blocks);
+#pragma omp parallel for schedule(dynamic, 1)
+                for (long i = 0; i < count; ++i) {
+                    loaded[i] = chain.at(first + i);
+                }
+
+                size_t transactions = 0;
+                for (const auto & block : loaded) transactions += block->transactions.size();
+                reserveLocked(transactions);
+                for (size_t i = 0; i < blocks; ++i) {
+                    const VTransactions& txs = loaded[i]->transactions;
+                    for (size_t k = 0; k < txs.size(); ++k) {
+                        insertLocked(txs[k].hash(), TxLocation{first + i, static_cast<uint32_t>(k)});
+                    }
+                }
+                indexed += blocks;
+            }
+            setTip(chain.size(), chain.head());
+            return indexed;
+        }
+
+        void sync() override {
+            std::lock_guard<std::mutex> lock(mutex);
+            table.sync();
+        }
+
+        void activeChainChanged(size_t firstHeight, const ChainUpdate& update) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < update.disconnected.size(); ++i) {
+                const uint64_t height = firstHeight + update.disconnected.size() - 1 - i;
+                for (const auto & transaction : update.disconnected[i].block->transactions) {
+                    eraseLocked(transaction.hash(), height);
+                }
+            }
+            for (size_t i = 0; i < update.connected.size(); ++i) {
+                addBlockLocked(firstHeight + i, *update.connected[i].block);
+            }
+            if (!update.connected.empty()) setTip(firstHeight + update.connected.size(), update.connected.back().hash);
+        }
+    };
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "vcoin.h"
+
+namespace VCoin
+{
+    struct VerificationFailure {
+        size_t height;
+        std::string hash;
+        std::string reason;
+    };
+
+    struct VerificationReport {
+        size_t blocks = 0;
+        size_t transactions = 0;
+        bool balancesChecked = false;
+        double seconds = 0;
+        std::vector<VerificationFailure> failures; // ordered by height
+
+        bool ok() const {
+            return failures.empty();
+        }
+
+        double blocksPerSecond() const {
+            return seconds > 0 ? blocks / seconds : 0;
+        }
+    };
+
+    // Re-verifies a whole active chain without trusting BlockChain::insert: every block's
+    // stored hash, proof of work, link to its parent, merkle root and transaction ids, and,
+    // given the genesis ledger, that no transaction spends more than its sender holds.
+    // Pruned blocks only get the header checks, and balances need an unpruned chain.
+    // Blocks are checked in batches fanned out over all OpenMP threads. The balance check
+    // has to run in chain order, so it runs on its own thread one batch behind, consuming
+    // batches while the next ones are being checked; at most kMaxQueuedBatches wait for it.
+    class ChainVerifier
+    {
+    private:
+        static const size_t kMaxQueuedBatches = 2;
+
+        struct Batch {
+            size_t firstHeight;
+            std::vector<VBlockHandle> blocks;
+        };
+
+        size_t batchSize;
+        uint8_t minDifficulty;
+
+        void checkHeader(const ChainSnapshot& chain, size_t height, const VBlockHeader& header, std::vector<std::string>& problems) const {
+            const std::string& hash = chain.hashAt(height);
+            std::string actual = header.hash();
+            if (actual != hash) problems.push_back("stored under " + hash + " but hashes to " + actual);
+            if (header.diffTarget < minDifficulty || !hashMeetsTarget(actual, header.diffTarget)) {
+                problems.push_back("does not meet difficulty target " + std::to_string(header.diffTarget));
+            }
+            if (height > 0 && header.prevBlock != chain.hashAt(height - 1)) {
+                problems.push_back("links to " + header.prevBlock + " instead of " + chain.hashAt(height - 1));
+            }
+        }
+
+        static void checkBody(const VBlock& block, std::vector<std::string>& problems) {
+            bc::hash_list txHashes;
+            txHashes.reserve(block.transactions.size());
+            for (size_t i = 0; i < block.transactions.size(); ++i) {
+                const VTransaction& transaction = block.transactions[i];
+                if (!transaction.hasValidId()) problems.push_back("transaction " + std::to_string(i) + " has id " + transaction.id + " but hashes to " + transaction.hashHex());
+                txHashes.push_back(transaction.hash());
+            }
+            std::string merkleRoot = bc::encode_base16(create_merkle(txHashes));
+            if (merkleRoot != block.merkleRootHash) problems.push_back("merkle root " + block.merkleRootHash + " does not match " + merkleRoot);
+        }
+
+        // Applies a block transaction by transaction, recording spends the sender cannot cover.
+        static void checkBalances(VUsers& ledger, size_t height, const std::string& hash, const VBlock& block,
+                                  std::vector<VerificationFailure>& failures) {
+            for (size_t i = 0; i < block.transactions.size(); ++i) {
+                const VTransaction& transaction = block.transactions[i];
+                double& senderBalance = ledger[transaction.sender()].balance;
+                if (senderBalance < transaction.sum()) {
+                    failures.push_back(VerificationFailure{height, hash, "transaction " + std::to_string(i) + " spends " +
+                            std::to_string(transaction.sum()) + " but its sender holds " + std::to_string(senderBalance)});
+                }
+                senderBalance -= transaction.sum();
+                ledger[transaction.receiver()].balance += transaction.sum();
+            }
+        }
+
+    public:
+        explicit ChainVerifier(size_t batchSize = 256, uint8_t minDifficulty = kCurrentDifficulty)
+                : batchSize(std::max<size_t>(batchSize, 1)), minDifficulty(minDifficulty) {}
+
+        // genesisLedger is the account table before block 1; without it, or on a pruned chain,
+        // balances are not checked.
+        VerificationReport verify(const ChainSnapshot& chain, const VUsers* genesisLedger = nullptr) const {
+            VerificationReport report;
+            auto start = std::chrono::steady_clock::now();
+
+            std::mutex mutex;
+            std::condition_variable changed;
+            std::deque<Batch> queue;
+            bool finished = false;
+            std::vector<VerificationFailure> balanceFailures;
+
+            std::thread ledgerThread;
+            if (genesisLedger != nullptr && chain.prunedHeight() == 0) {
+                report.balancesChecked = true;
+                ledgerThread = std::thread([&]() {
+                    VUsers ledger(*genesisLedger);
+                    while (true) {
+                        Batch batch;
+                        {
+                            std::unique_lock<std::mutex> lock(mutex);
+                            changed.wait(lock, [&]() { return !queue.empty() || finished; });
+                            if (queue.empty()) return;
+                            batch = std::move(queue.front());
+                            queue.pop_front();
+                        }
+                        changed.notify_all();
+                        for (size_t i = 0; i < batch.blocks.size(); ++i) {
+                            size_t height = batch.firstHeight + i;
+                            // The genesis block's transactions are already part of the ledger.
+                            if (height == 0 || !batch.blocks[i]) continue;
+                            checkBalances(ledger, height, chain.hashAt(height), *batch.blocks[i], balanceFailures);
+                        }
+                    }
+                });
+            }
+
+            for (size_t first = 0; first < chain.size(); first += batchSize) {
+                const size_t count = std::min(batchSize, chain.size() - first);
+                Batch batch{first, std::vector<VBlockHandle>(count)};
+                std::vector<std::vector<std::string>> problems(count);
+                size_t transactions = 0;
+
+                const long blocks = static_cast<long>(count);
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:transactions)
+                for (long i = 0; i < blocks; ++i) {
+                    size_t height = first + i;
+                    try {
+                        checkHeader(chain, height, *chain.header(height), problems[i]);
+                        if (height < chain.prunedHeight()) continue;
+                        batch.blocks[i] = chain.at(height);
+                        checkBody(*batch.blocks[i], problems[i]);
+                        transactions += batch.blocks[i]->transactions.size();
+                    }
+                    catch (const std::exception& e) {
+                        batch.blocks[i].reset();
+                        problems[i].push_back(std::string("could not be loaded: ") + e.what());
+                    }
+                }
+
+                for (size_t i = 0; i < count; ++i) {
+                    for (auto & problem : problems[i]) {
+                        report.failures.push_back(VerificationFailure{first + i, chain.hashAt(first + i), std::move(problem)});
+                    }
+                }
+                report.blocks += count;
+                report.transactions += transactions;
+
+                if (report.balancesChecked) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&]() { return queue.size() < kMaxQueuedBatches; });
+                    queue.push_back(std::move(batch));
+                    changed.notify_all();
+                }
+            }
+
+            if (ledgerThread.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finished = true;
+                }
+                changed.notify_all();
+                ledgerThread.join();
+            }
+
+            report.failures.insert(report.failures.end(), balanceFailures.begin(), balanceFailures.end());
+            std::stable_sort(report.failures.begin(), report.failures.end(),
+                             [](const VerificationFailure& a, const VerificationFailure& b) { return a.height < b.height; });
+            report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return report;
+        }
+    };
+}